@@ -1,11 +1,21 @@
 #include <stdlib.h>
+#include <math.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <string.h>
+#include <stdio.h>
 #include <assert.h>
 #include <setjmp.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#endif
 
 
 #ifdef _WIN32
@@ -23,6 +33,8 @@
 #define LOS_ESRC  -4
 #define LOS_ESTR  -5
 #define LOS_EFMT  -6
+#define LOS_EIO   -7
+#define LOS_EMEM  -8
 
 #define SIGN_FLT    0xf0
 #define SIGN_INT1   0xf1
@@ -38,10 +50,34 @@
 #define SIGN_TBLBEG 0xfb
 #define SIGN_TBLSEP 0xfc
 #define SIGN_TBLEND 0xfd
+#define SIGN_TBLSIZ 0xe0
+#define SIGN_HDR    0xe1
+#define SIGN_STRREF 0xe2
+#define SIGN_TBLREF 0xe3
+#define SIGN_SHAPE  0xe4
+#define SIGN_SHPDEF 0xe5
+#define SIGN_COLUMNS 0xe6
+#define SIGN_ARRAY  0xe7
+#define SIGN_VINT   0xe8
+#define SIGN_VSTR   0xe9
+#define SIGN_INDEX  0xea
 #define SIGN_SHRSTR 0xc0
 #define MASK_SHRINT 0xc0
 #define MASK_SHRSTR 0xe0
 
+#define FLAG_STRREF 0x01
+#define FLAG_TBLREF 0x02
+#define FLAG_SHAPE  0x04
+#define FLAG_COLUMN 0x08
+#define FLAG_VARINT 0x10
+#define FLAG_LZ     0x20
+#define FLAG_INDEX  0x40
+#define FLAG_TBLSIZ 0x80
+#define FLAG_ALL    (FLAG_STRREF | FLAG_TBLREF | FLAG_SHAPE | FLAG_COLUMN | FLAG_VARINT | FLAG_LZ | \
+                     FLAG_INDEX | FLAG_TBLSIZ)
+
+#define OPT_CANON   0x100
+
 #define IS_SHRINT(v) (((v) & MASK_SHRINT) != 0xc0)
 #define IS_SHRSTR(v) (((v) & MASK_SHRSTR) == 0xc0)
 
@@ -65,6 +101,18 @@
     (((uint64_t)(x) & 0x000000000000ff00ULL) << 40) | \
     (((uint64_t)(x) & 0x00000000000000ffULL) << 56)))
 
+#if defined(__GNUC__) || defined(__clang__)
+#define bswap16(x) __builtin_bswap16(x)
+#define bswap32(x) __builtin_bswap32(x)
+#define bswap64(x) __builtin_bswap64(x)
+#define los_inline static inline __attribute__((always_inline))
+#else
+#define bswap16(x) swap16(x)
+#define bswap32(x) swap32(x)
+#define bswap64(x) swap64(x)
+#define los_inline static inline
+#endif
+
 typedef union ucast
 {
     double   f;
@@ -92,765 +140,6435 @@ typedef union ucast
 #define checkdestlen(len, need) checkbuflen(len, need, LOS_EBUF)
 #define checksrclen(len, need) checkbuflen(len, need, LOS_ESRC)
 
-static lua_CFunction str_format = NULL;
+/*
+** Growable output buffer for the string forms of dump and pack.
+** luaL_Buffer can't be used here: since Lua 5.4 it keeps a box at the
+** top of the stack, while the encoders push the values they visit on top
+** of it. The box of losbuf lives in a fixed stack slot instead, so the
+** encoders are free to use the stack above it.
+**
+** With a flush function set the buffer doesn't grow: whenever it is
+** full its content is handed to the flush function and it starts over,
+** so streaming to a sink takes one chunk of memory. A buffer without a
+** box is a fixed one and fails with EBUF instead of growing.
+*/
+#define LOSBUF_INITSIZE 1024
+#define LOSBUF_CHUNKSIZE 65536
 
+typedef struct losbuf losbuf;
+typedef void (*losbuf_Flush)(losbuf* B, const char* s, size_t len);
 
-static size_t dump(jmp_buf E, lua_State* L, luaL_Buffer* B)
+struct losbuf
 {
-    int type = lua_type(L, -1);
-    switch (type)
-    {
-    case LUA_TNIL: {
-        luaL_addchar(B, SIGN_NIL);
-        return 1;
-    }
-    case LUA_TBOOLEAN: {
-        luaL_addchar(B, lua_toboolean(L, -1) ? SIGN_TRUE : SIGN_FALSE);
-        return 1;
-    }
-    case LUA_TNUMBER: {
-        if (lua_isinteger(L, -1)) {
-            int64_t v = lua_tointeger(L, -1);
-            if (-63 <= v && v <= 127) {
-                int8_t i = (int8_t)v;
-                luaL_addchar(B, i);
-                return 1;
-            }
-            else if (INT8_MIN <= v && v <= INT8_MAX) {
-                int8_t i = (int8_t)v;
-                luaL_addchar(B, SIGN_INT1);
-                luaL_addchar(B, i);
-                return 2;
-            }
-            else if (INT16_MIN <= v && v <= INT16_MAX) {
-                int16_t i = (int16_t)v;
-                luaL_addchar(B, SIGN_INT2);
-                luaL_addlstring(B, (const char*)&i, 2);
-                return 3;
-            }
-            else if (INT32_MIN <= v && v <= INT32_MAX) {
-                int32_t i = (int32_t)v;
-                luaL_addchar(B, SIGN_INT4);
-                luaL_addlstring(B, (const char*)&i, 4);
-                return 5;
-            }
-            else {
-                luaL_addchar(B, SIGN_INT8);
-                luaL_addlstring(B, (const char*)&v, 8);
-                return 9;
-            }
-        }
-        else {
-            double v = lua_tonumber(L, -1);
-            luaL_addchar(B, SIGN_FLT);
-            luaL_addlstring(B, (const char*)&v, 8);
-            return 9;
-        }
-    }
-    case LUA_TSTRING: {
-        size_t len;
-        const char* s = lua_tolstring(L, -1, &len);
-        size_t size = len;
-        if (len <= 31) {
-            uint8_t c = (uint8_t)len;
-            c |= SIGN_SHRSTR;
-            luaL_addchar(B, c);
-            size += 1;
-        }
-        else if (len <= UINT8_MAX) {
-            uint8_t c = (uint8_t)len;
-            luaL_addchar(B, SIGN_STR1);
-            luaL_addchar(B, c);
-            size += 2;
-        }
-        else if (len <= UINT16_MAX) {
-            luaL_addchar(B, SIGN_STR2);
-            luaL_addlstring(B, (const char*)&len, 2);
-            size += 3;
-        }
-        else if (len <= UINT32_MAX) {
-            luaL_addchar(B, SIGN_STR4);
-            luaL_addlstring(B, (const char*)&len, 4);
-            size += 5;
-        }
-        else {
-            los_throw(E, LOS_ESTR);
+    lua_State* L;
+    char*  b;
+    size_t size;
+    size_t n;
+    int    box;
+    losbuf_Flush flush;
+    FILE*  file;
+    int    func;
+    jmp_buf* E;
+    losbuf* next;
+    char*  work;
+    size_t nout;
+    char   init[LOSBUF_INITSIZE];
+};
+
+#define losbuf_addchar(B, c) \
+    ((void)((B)->n < (B)->size || losbuf_prep((B), 1)), \
+     ((B)->b[(B)->n++] = (char)(c)))
+
+#define losbuf_addliteral(B, s) losbuf_addlstring(B, "" s, sizeof(s) - 1)
+
+
+static void losbuf_init(lua_State* L, losbuf* B)
+{
+    B->L = L;
+    B->b = B->init;
+    B->size = LOSBUF_INITSIZE;
+    B->n = 0;
+    B->flush = NULL;
+    B->file = NULL;
+    B->func = 0;
+    B->E = NULL;
+    lua_pushnil(L);
+    B->box = lua_gettop(L);
+}
+
+
+static void losbuf_resize(losbuf* B, size_t newsize)
+{
+    char* newbuf = lua_newuserdatauv(B->L, newsize, 0);
+    memcpy(newbuf, B->b, B->n);
+    lua_replace(B->L, B->box);
+    B->b = newbuf;
+    B->size = newsize;
+}
+
+
+static char* losbuf_prep(losbuf* B, size_t sz)
+{
+    if (B->size - B->n < sz) {
+        if (B->flush && B->n > 0) {
+            B->flush(B, B->b, B->n);
+            B->n = 0;
         }
-        luaL_addlstring(B, s, len);
-        return size;
-    }
-    case LUA_TTABLE: {
-        luaL_addchar(B, SIGN_TBLBEG);
-        size_t size = 1;
-        size_t len = lua_rawlen(L, -1);
-        size_t numnil = 0;
-        for (size_t i = 1; i <= len; ++i) {
-            if (lua_rawgeti(L, -1, i) == LUA_TNIL) {
-                ++numnil;
+        if (B->size - B->n < sz) {
+            if (B->box == 0) {
+                los_throw(*B->E, LOS_EBUF);
             }
-            else {
-                for (size_t j = 0; j < numnil; ++j) {
-                    luaL_addchar(B, SIGN_NIL);
-                }
-                size += numnil;
-                numnil = 0;
-                size += dump(E, L, B);
+            size_t newsize = B->size * 2;
+            if (newsize - B->n < sz) {
+                newsize = B->n + sz;
             }
-            lua_pop(L, 1);
-        }
-        luaL_addchar(B, SIGN_TBLSEP);
-        ++size;
-        int top = lua_gettop(L);
-        if (len > 0) {
-            size_t lastkey = len - numnil;
-            lua_pushinteger(L, lastkey);
-        }
-        else {
-            lua_pushnil(L);
+            losbuf_resize(B, newsize);
         }
-        while (lua_next(L, -2)) {
-            size += dump(E, L, B);
-            lua_pop(L, 1);
-            size += dump(E, L, B);
-        }
-        lua_settop(L, top);
-        luaL_addchar(B, SIGN_TBLEND);
-        ++size;
-        return size;
     }
-    default: {
-        los_throw(E, LOS_ETYPE);
+    return B->b + B->n;
+}
+
+
+static void losbuf_addlstring(losbuf* B, const char* s, size_t len)
+{
+    if (B->flush && len > B->size) {
+        if (B->n > 0) {
+            B->flush(B, B->b, B->n);
+            B->n = 0;
+        }
+        B->flush(B, s, len);
+        return;
     }
+    memcpy(losbuf_prep(B, len), s, len);
+    B->n += len;
+}
+
+
+static void losbuf_pushresult(losbuf* B)
+{
+    lua_pushlstring(B->L, B->b, B->n);
+}
+
+
+static void losbuf_flushfile(losbuf* B, const char* s, size_t len)
+{
+    if (fwrite(s, 1, len, B->file) != len) {
+        los_throw(*B->E, LOS_EIO);
     }
-    return 0;
 }
 
 
-static size_t dump_x(jmp_buf E, lua_State* L, luaL_Buffer* B)
+static void losbuf_flushfunc(losbuf* B, const char* s, size_t len)
 {
-    int type = lua_type(L, -1);
-    switch (type)
-    {
-    case LUA_TNIL: {
-        luaL_addchar(B, SIGN_NIL);
-        return 1;
+    lua_State* L = B->L;
+    luaL_checkstack(L, 2, NULL);
+    lua_pushvalue(L, B->func);
+    lua_pushlstring(L, s, len);
+    lua_call(L, 1, 0);
+}
+
+
+/*
+** Sets the buffer up to stream into the sink at stack index idx, either
+** a Lua file handle or a function called with each chunk.
+*/
+static void losbuf_initsink(lua_State* L, losbuf* B, int idx, size_t chunk, jmp_buf* E)
+{
+    luaL_Stream* p = luaL_testudata(L, idx, LUA_FILEHANDLE);
+    if (p) {
+        luaL_argcheck(L, p->closef != NULL, idx, "attempt to use a closed file");
+        losbuf_init(L, B);
+        B->flush = losbuf_flushfile;
+        B->file = p->f;
     }
-    case LUA_TBOOLEAN: {
-        luaL_addchar(B, lua_toboolean(L, -1) ? SIGN_TRUE : SIGN_FALSE);
-        return 1;
+    else {
+        luaL_argexpected(L, lua_isfunction(L, idx), idx, "file or function");
+        losbuf_init(L, B);
+        B->flush = losbuf_flushfunc;
+        B->func = idx;
     }
-    case LUA_TNUMBER: {
-        if (lua_isinteger(L, -1)) {
-            int64_t v = lua_tointeger(L, -1);
-            if (-63 <= v && v <= 127) {
-                int8_t i = (int8_t)v;
-                luaL_addchar(B, i);
-                return 1;
-            }
-            else if (INT8_MIN <= v && v <= INT8_MAX) {
-                int8_t i = (int8_t)v;
-                luaL_addchar(B, SIGN_INT1);
-                luaL_addchar(B, i);
-                return 2;
-            }
-            else if (INT16_MIN <= v && v <= INT16_MAX) {
-                int16_t i = (int16_t)v;
-                i = swap16(i);
-                luaL_addchar(B, SIGN_INT2);
-                luaL_addlstring(B, (const char*)&i, 2);
-                return 3;
-            }
-            else if (INT32_MIN <= v && v <= INT32_MAX) {
-                int32_t i = (int32_t)v;
-                i = swap32(i);
-                luaL_addchar(B, SIGN_INT4);
-                luaL_addlstring(B, (const char*)&i, 4);
-                return 5;
-            }
-            else {
-                v = swap64(v);
-                luaL_addchar(B, SIGN_INT8);
-                luaL_addlstring(B, (const char*)&v, 8);
-                return 9;
-            }
-        }
-        else {
-            double v = lua_tonumber(L, -1);
-            int64_t i = *(int64_t*)&v;
-            i = swap64(i);
-            luaL_addchar(B, SIGN_FLT);
-            luaL_addlstring(B, (const char*)&i, 8);
-        }
+    B->E = E;
+    if (chunk > B->size) {
+        losbuf_resize(B, chunk);
     }
-    case LUA_TSTRING: {
-        size_t len;
-        const char* s = lua_tolstring(L, -1, &len);
-        size_t size = len;
-        if (len <= 31) {
-            uint8_t c = (uint8_t)len;
-            c |= SIGN_SHRSTR;
-            luaL_addchar(B, c);
-            size += 1;
-        }
-        else if (len <= UINT8_MAX) {
-            uint8_t c = (uint8_t)len;
-            luaL_addchar(B, SIGN_STR1);
-            luaL_addchar(B, c);
-            size += 2;
-        }
-        else if (len <= UINT16_MAX) {
-            uint16_t i = (uint16_t)len;
-            i = swap16(i);
-            luaL_addchar(B, SIGN_STR2);
-            luaL_addlstring(B, (const char*)&i, 2);
-            size += 3;
-        }
-        else if (len <= UINT32_MAX) {
-            uint32_t i = (uint32_t)len;
-            i = swap32(i);
-            luaL_addchar(B, SIGN_STR4);
-            luaL_addlstring(B, (const char*)&i, 4);
-            size += 5;
-        }
-        else {
-            los_throw(E, LOS_ESTR);
-        }
-        luaL_addlstring(B, s, len);
-        return size;
+}
+
+
+static void losbuf_flushall(losbuf* B)
+{
+    if (B->n > 0) {
+        B->flush(B, B->b, B->n);
+        B->n = 0;
     }
-    case LUA_TTABLE: {
-        luaL_addchar(B, SIGN_TBLBEG);
-        size_t size = 1;
-        size_t len = lua_rawlen(L, -1);
-        size_t numnil = 0;
-        for (size_t i = 1; i <= len; ++i) {
-            if (lua_rawgeti(L, -1, i) == LUA_TNIL) {
-                ++numnil;
-            }
-            else {
-                for (size_t j = 0; j < numnil; ++j) {
-                    luaL_addchar(B, SIGN_NIL);
-                }
-                size += numnil;
-                numnil = 0;
-                size += dump_x(E, L, B);
-            }
-            lua_pop(L, 1);
-        }
-        luaL_addchar(B, SIGN_TBLSEP);
-        ++size;
-        int top = lua_gettop(L);
-        if (len > 0) {
-            size_t lastkey = len - numnil;
-            lua_pushinteger(L, lastkey);
-        }
-        else {
-            lua_pushnil(L);
-        }
-        while (lua_next(L, -2)) {
-            size += dump_x(E, L, B);
-            lua_pop(L, 1);
-            size += dump_x(E, L, B);
+}
+
+
+/*
+** The binary encoder is written once and specialized at compile time on
+** the byte order and on the sink it writes to: a losbuf that grows or
+** flushes (SINK_BUF), a bounded raw buffer failing with EBUF when full
+** (SINK_FIXED), or nothing at all, only counting the length (SINK_COUNT).
+** The sink functions take the sink as a constant so that each
+** specialization keeps only its own branch.
+*/
+#define SINK_BUF   0
+#define SINK_FIXED 1
+#define SINK_COUNT 2
+
+
+static void losbuf_initfixed(lua_State* L, losbuf* B, char* b, size_t size, jmp_buf* E)
+{
+    B->L = L;
+    B->b = b;
+    B->size = size;
+    B->n = 0;
+    B->box = 0;
+    B->flush = NULL;
+    B->file = NULL;
+    B->func = 0;
+    B->E = E;
+}
+
+
+static void losbuf_initcount(lua_State* L, losbuf* B)
+{
+    losbuf_initfixed(L, B, NULL, 0, NULL);
+}
+
+
+los_inline char* sinkprep(losbuf* B, size_t len, int sink)
+{
+    if (B->size - B->n < len) {
+        if (sink == SINK_FIXED) {
+            los_throw(*B->E, LOS_EBUF);
         }
-        lua_settop(L, top);
-        luaL_addchar(B, SIGN_TBLEND);
-        ++size;
-        return size;
+        losbuf_prep(B, len);
     }
-    default: {
-        los_throw(E, LOS_ETYPE);
+    return B->b + B->n;
+}
+
+
+los_inline void sinkchar(losbuf* B, int c, int sink)
+{
+    if (sink != SINK_COUNT) {
+        *sinkprep(B, 1, sink) = (char)c;
+    }
+    ++B->n;
+}
+
+
+los_inline void sinkmem(losbuf* B, const void* s, size_t len, int sink)
+{
+    if (sink == SINK_COUNT) {
+        B->n += len;
+        return;
     }
+    if (sink == SINK_BUF && B->size - B->n < len) {
+        losbuf_addlstring(B, s, len);
+        return;
     }
-    return 0;
+    memcpy(sinkprep(B, len, sink), s, len);
+    B->n += len;
 }
 
 
-static size_t dumpbuf(jmp_buf E, lua_State* L, char* B, size_t buflen)
+los_inline uint16_t get16(const char* p, int swap)
 {
-    int type = lua_type(L, -1);
-    switch (type)
-    {
-    case LUA_TNIL: {
-        checkdestlen(buflen, 1);
-        B[0] = SIGN_NIL;
-        return 1;
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return swap ? bswap16(v) : v;
+}
+
+
+los_inline uint32_t get32(const char* p, int swap)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swap ? bswap32(v) : v;
+}
+
+
+los_inline uint64_t get64(const char* p, int swap)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return swap ? bswap64(v) : v;
+}
+
+
+los_inline void put16(char* p, uint16_t v, int swap)
+{
+    v = swap ? bswap16(v) : v;
+    memcpy(p, &v, 2);
+}
+
+
+los_inline void put32(char* p, uint32_t v, int swap)
+{
+    v = swap ? bswap32(v) : v;
+    memcpy(p, &v, 4);
+}
+
+
+los_inline void put64(char* p, uint64_t v, int swap)
+{
+    v = swap ? bswap64(v) : v;
+    memcpy(p, &v, 8);
+}
+
+
+/*
+** Options beyond the plain format are recorded as flags in a header,
+** SIGN_HDR and a flags byte in front of the object, and the state they
+** need during one call is kept in a losctx. Its tables live in fixed
+** stack slots below the values being walked. Options changing only the
+** order things are written in, such as canonical, take the bits above the
+** flags byte and aren't recorded.
+*/
+typedef struct loskey loskey;
+
+typedef struct losctx
+{
+    int flags;
+    int strs;
+    int tbls;
+    int shapes;
+    int keys;
+    int keybox;
+    lua_Integer nstr;
+    lua_Integer ntbl;
+    lua_Integer nshape;
+    loskey* sorted;
+    size_t nkey;
+    size_t maxkey;
+    losbuf* lens;
+    size_t ilen;
+} losctx;
+
+
+static int dumpopts(lua_State* L, int idx)
+{
+    static const struct { const char* name; int flag; } opts[] = {
+        {"dedup", FLAG_STRREF},
+        {"refs", FLAG_TBLREF},
+        {"shapes", FLAG_SHAPE},
+        {"columnar", FLAG_COLUMN},
+        {"compact", FLAG_VARINT},
+        {"compress", FLAG_LZ},
+        {"index", FLAG_INDEX},
+        {"presize", FLAG_TBLSIZ},
+        {"canonical", OPT_CANON},
+        {NULL, 0}
+    };
+    if (lua_isnoneornil(L, idx)) {
+        return 0;
     }
-    case LUA_TBOOLEAN: {
-        checkdestlen(buflen, 1);
-        B[0] = lua_toboolean(L, -1) ? SIGN_TRUE : SIGN_FALSE;
-        return 1;
+    luaL_checktype(L, idx, LUA_TTABLE);
+    int flags = 0;
+    for (int i = 0; opts[i].name; ++i) {
+        lua_getfield(L, idx, opts[i].name);
+        if (lua_toboolean(L, -1)) {
+            flags |= opts[i].flag;
+        }
+        lua_pop(L, 1);
     }
-    case LUA_TNUMBER: {
-        if (lua_isinteger(L, -1)) {
-            int64_t v = lua_tointeger(L, -1);
-            if (-63 <= v && v <= 127) {
-                checkdestlen(buflen, 1);
-                int8_t i = (int8_t)v;
-                B[0] = i;
-                return 1;
+    if ((flags & FLAG_TBLREF) && (flags & FLAG_COLUMN)) {
+        luaL_argerror(L, idx, "refs and columnar can't be combined");
+    }
+    return flags;
+}
+
+
+static void ctxinit(lua_State* L, losctx* C, int flags)
+{
+    C->flags = flags;
+    C->strs = 0;
+    C->tbls = 0;
+    C->shapes = 0;
+    C->keys = 0;
+    C->keybox = 0;
+    C->nstr = 0;
+    C->ntbl = 0;
+    C->nshape = 0;
+    C->sorted = NULL;
+    C->nkey = 0;
+    C->maxkey = 0;
+    C->lens = NULL;
+    C->ilen = 0;
+    if (flags & FLAG_STRREF) {
+        lua_newtable(L);
+        C->strs = lua_gettop(L);
+    }
+    if (flags & FLAG_TBLREF) {
+        lua_newtable(L);
+        C->tbls = lua_gettop(L);
+    }
+    if (flags & FLAG_SHAPE) {
+        lua_newtable(L);
+        C->shapes = lua_gettop(L);
+    }
+    if (flags & OPT_CANON) {
+        lua_newtable(L);
+        C->keys = lua_gettop(L);
+        lua_pushnil(L);
+        C->keybox = lua_gettop(L);
+    }
+}
+
+
+#define hdrlen(C) (((C)->flags & FLAG_ALL) ? 2 : 0)
+
+
+los_inline size_t dumphdr(losctx* C, losbuf* B, int sink)
+{
+    if (C->flags & FLAG_ALL) {
+        sinkchar(B, SIGN_HDR, sink);
+        sinkchar(B, C->flags & FLAG_ALL, sink);
+    }
+    return hdrlen(C);
+}
+
+
+static size_t readhdr(jmp_buf E, const char* B, size_t buflen, int* flags)
+{
+    *flags = 0;
+    if (buflen > 0 && (uint8_t)B[0] == SIGN_HDR) {
+        checksrclen(buflen, 2);
+        *flags = (uint8_t)B[1];
+        if (*flags & ~FLAG_ALL) {
+            los_throw(E, LOS_ESIGN);
+        }
+        return 2;
+    }
+    return 0;
+}
+
+
+static size_t loadhdr(jmp_buf E, lua_State* L, losctx* C, const char* B, size_t buflen)
+{
+    int flags;
+    size_t n = readhdr(E, B, buflen, &flags);
+    ctxinit(L, C, flags);
+    return n;
+}
+
+
+/*
+** Length of the fixed form of an integer. Short integers are the bytes
+** below SIGN_SHRSTR read as int8_t: 0..127 and -128..-65.
+*/
+#define isshrint(v) ((0 <= (v) && (v) <= 127) || (-128 <= (v) && (v) <= -65))
+
+static size_t intlen(int64_t v)
+{
+    if (isshrint(v)) {
+        return 1;
+    }
+    else if (INT8_MIN <= v && v <= INT8_MAX) {
+        return 2;
+    }
+    else if (INT16_MIN <= v && v <= INT16_MAX) {
+        return 3;
+    }
+    else if (INT32_MIN <= v && v <= INT32_MAX) {
+        return 5;
+    }
+    else {
+        return 9;
+    }
+}
+
+
+/*
+** Unsigned LEB128 varints: 7 bits per byte, low bits first, the high bit
+** set on every byte but the last. Signed values are zigzag mapped first,
+** so that small negative values stay short.
+*/
+#define VARINT_MAXLEN 10
+
+#define zigzag(d)   (((d) << 1) ^ (uint64_t)((int64_t)(d) >> 63))
+#define unzigzag(z) (((z) >> 1) ^ (uint64_t)-(int64_t)((z) & 1))
+
+/*
+** In compact mode integers wider than a byte are written as SIGN_VINT and
+** a zigzag varint, and strings beyond the short ones as SIGN_VSTR, the
+** length as a varint and the bytes. Nothing but floats then depends on
+** the endian.
+*/
+#define isvint(v) (intlen(v) > 2)
+
+
+static size_t putvarint(char* B, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        B[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    B[n++] = (char)v;
+    return n;
+}
+
+
+static size_t varintlen(uint64_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+
+static size_t getvarint(jmp_buf E, const char* B, size_t buflen, uint64_t* v)
+{
+    uint64_t r = 0;
+    for (size_t i = 0; i < VARINT_MAXLEN; ++i) {
+        checksrclen(buflen, i + 1);
+        uint8_t c = (uint8_t)B[i];
+        r |= (uint64_t)(c & 0x7f) << (7 * i);
+        if (c < 0x80) {
+            *v = r;
+            return i + 1;
+        }
+    }
+    los_throw(E, LOS_ESIGN);
+    return 0;
+}
+
+
+static void losbuf_addvarint(losbuf* B, uint64_t v)
+{
+    char p[VARINT_MAXLEN];
+    losbuf_addlstring(B, p, putvarint(p, v));
+}
+
+
+/*
+** With dedup on, strings of at least STRREF_MIN bytes are numbered in
+** the order they are first written, and later copies are written as
+** SIGN_STRREF followed by that number as a varint. With refs on, tables
+** are numbered the same way and written again as SIGN_TBLREF, which
+** keeps shared tables shared and lets cycles through.
+** newref returns the number of the value on the top if it was written
+** before, otherwise it numbers it in the map at refs and returns -1.
+** A table is numbered when it is begun, so load numbers it right after
+** creating it, before filling it.
+*/
+#define STRREF_MIN 2
+
+#define strref(L, C) newref(L, (C)->strs, &(C)->nstr)
+#define tblref(L, C) newref(L, (C)->tbls, &(C)->ntbl)
+#define loadstrref(E, L, B, buflen, C) \
+    loadref(E, L, B, buflen, (C)->flags & FLAG_STRREF, (C)->strs, (C)->nstr)
+#define loadtblref(E, L, B, buflen, C) \
+    loadref(E, L, B, buflen, (C)->flags & FLAG_TBLREF, (C)->tbls, (C)->ntbl)
+
+
+static lua_Integer newref(lua_State* L, int refs, lua_Integer* n)
+{
+    lua_pushvalue(L, -1);
+    if (lua_rawget(L, refs) == LUA_TNUMBER) {
+        lua_Integer ref = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        return ref;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_pushinteger(L, (*n)++);
+    lua_rawset(L, refs);
+    return -1;
+}
+
+
+static void strdef(lua_State* L, losctx* C, size_t len)
+{
+    if ((C->flags & FLAG_STRREF) && len >= STRREF_MIN) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, C->strs, ++C->nstr);
+    }
+}
+
+
+static void tbldef(lua_State* L, losctx* C)
+{
+    if (C->flags & FLAG_TBLREF) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, C->tbls, ++C->ntbl);
+    }
+}
+
+
+static size_t loadref(jmp_buf E, lua_State* L, const char* B, size_t buflen,
+                      int on, int refs, lua_Integer n)
+{
+    uint64_t ref;
+    size_t len = 1 + getvarint(E, B + 1, buflen - 1, &ref);
+    if (!on || ref >= (uint64_t)n) {
+        los_throw(E, LOS_ESIGN);
+    }
+    lua_rawgeti(L, refs, (lua_Integer)ref + 1);
+    return len;
+}
+
+
+/*
+** With presize on, tables holding at least TBLSIZ_MIN items are written
+** with a size hint right after SIGN_TBLBEG: SIGN_TBLSIZ followed by the
+** array count and the hash count as two integers, so that load can
+** presize the table. The flag in the header makes readers that predate
+** the hint reject the object up front. Readers take the hint wherever it
+** appears, since an index block always starts with one.
+*/
+#define TBLSIZ_MIN 4
+
+#define isarraykey(L, narr) \
+    (lua_isinteger(L, -2) && (lua_Unsigned)lua_tointeger(L, -2) - 1 < (narr))
+
+
+static size_t hashlen(lua_State* L, size_t narr)
+{
+    size_t nrec = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (!isarraykey(L, narr)) {
+            ++nrec;
+        }
+        lua_pop(L, 1);
+    }
+    return nrec;
+}
+
+
+/*
+** With canonical on, equal tables are written the same whatever order
+** their keys were inserted in. The array part ends at the first border
+** instead of whichever border lua_rawlen finds, and the hash part is
+** written in the order of its keys: booleans, numbers, then strings, each
+** by value, strings bytewise; tables as keys can't be ordered and follow
+** in the order lua_next visits them. The keys of the tables being written
+** are stacked in a scratch table of the context, one run per table, and
+** sorted in C through an array of loskey.
+*/
+struct loskey
+{
+    int type;
+    int isint;
+    lua_Integer i;
+    lua_Number d;
+    const char* s;
+    size_t len;
+    lua_Integer idx;
+};
+
+typedef struct lositer
+{
+    size_t base;
+    size_t n;
+    size_t i;
+} lositer;
+
+
+static size_t tablelen(lua_State* L, losctx* C)
+{
+    size_t n = lua_rawlen(L, -1);
+    if (C->flags & OPT_CANON) {
+        for (size_t i = 1; i <= n; ++i) {
+            int type = lua_rawgeti(L, -1, i);
+            lua_pop(L, 1);
+            if (type == LUA_TNIL) {
+                return i - 1;
+            }
+        }
+    }
+    return n;
+}
+
+
+static int keycmp(const void* a, const void* b)
+{
+    const loskey* x = a;
+    const loskey* y = b;
+    if (x->type != y->type) {
+        return x->type < y->type ? -1 : 1;
+    }
+    switch (x->type)
+    {
+    case LUA_TBOOLEAN: {
+        return (int)(x->i - y->i);
+    }
+    case LUA_TNUMBER: {
+        if (x->isint && y->isint) {
+            return x->i < y->i ? -1 : x->i > y->i;
+        }
+        lua_Number u = x->isint ? (lua_Number)x->i : x->d;
+        lua_Number v = y->isint ? (lua_Number)y->i : y->d;
+        if (u != v) {
+            return u < v ? -1 : 1;
+        }
+        return y->isint - x->isint;
+    }
+    case LUA_TSTRING: {
+        int c = memcmp(x->s, y->s, x->len < y->len ? x->len : y->len);
+        if (c != 0) {
+            return c;
+        }
+        return x->len < y->len ? -1 : x->len > y->len;
+    }
+    }
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+
+static void growkeys(lua_State* L, losctx* C, size_t n)
+{
+    size_t size = C->maxkey ? C->maxkey * 2 : 64;
+    loskey* keys = lua_newuserdatauv(L, size * sizeof(loskey), 0);
+    if (n > 0) {
+        memcpy(keys, C->sorted, n * sizeof(loskey));
+    }
+    lua_replace(L, C->keybox);
+    C->sorted = keys;
+    C->maxkey = size;
+}
+
+
+/*
+** Stacks the keys of the hash part of the table at t and sorts them,
+** returning their count.
+*/
+static size_t sortkeys(lua_State* L, losctx* C, int t, size_t narr)
+{
+    luaL_checkstack(L, 3, NULL);
+    size_t base = C->nkey;
+    size_t n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+        if (isarraykey(L, narr)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pop(L, 1);
+        if (base + n == C->maxkey) {
+            growkeys(L, C, base + n);
+        }
+        loskey* K = &C->sorted[base + n];
+        K->type = lua_type(L, -1);
+        K->isint = 0;
+        K->i = 0;
+        K->d = 0;
+        K->s = NULL;
+        K->len = 0;
+        if (K->type == LUA_TNUMBER) {
+            K->i = lua_tointegerx(L, -1, &K->isint);
+            K->d = lua_tonumber(L, -1);
+        }
+        else if (K->type == LUA_TSTRING) {
+            K->s = lua_tolstring(L, -1, &K->len);
+        }
+        else if (K->type == LUA_TBOOLEAN) {
+            K->i = lua_toboolean(L, -1);
+        }
+        K->idx = (lua_Integer)(base + n + 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, C->keys, K->idx);
+        ++n;
+    }
+    qsort(C->sorted + base, n, sizeof(loskey), keycmp);
+    C->nkey = base + n;
+    return n;
+}
+
+
+/*
+** Walks the hash part of the table at t as lua_next does, key and value
+** pushed and the key left for the next step, in key order with canonical
+** on. hashfirst starts the walk in place of pushing nil.
+*/
+static void hashfirst(lua_State* L, losctx* C, lositer* I, int t, size_t narr)
+{
+    if (C->flags & OPT_CANON) {
+        I->base = C->nkey;
+        I->n = sortkeys(L, C, t, narr);
+        I->i = 0;
+    }
+    lua_pushnil(L);
+}
+
+
+static int hashnext(lua_State* L, losctx* C, lositer* I, int t)
+{
+    if (!(C->flags & OPT_CANON)) {
+        return lua_next(L, t);
+    }
+    lua_pop(L, 1);
+    if (I->i == I->n) {
+        C->nkey = I->base;
+        return 0;
+    }
+    lua_rawgeti(L, C->keys, C->sorted[I->base + I->i++].idx);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, t);
+    return 1;
+}
+
+
+/*
+** With shapes on, a table holding string keys only is written by its list
+** of keys, in the order lua_next visits them or, with canonical on, sorted.
+** The first table with a list
+** is written as SIGN_SHPDEF, the key count as a varint, the keys and the
+** values; it defines the next shape number. Later tables with the same
+** list are written as SIGN_SHAPE, the shape number as a varint and the
+** values alone, so load knows the size and the keys up front.
+** The encoder finds shapes through a trie of tables keyed by the keys,
+** the last node holding the shape number under the key true. The loader
+** keeps the key lists in an array.
+*/
+static size_t dump(jmp_buf E, lua_State* L, losbuf* B, losctx* C);
+static size_t dump_x(jmp_buf E, lua_State* L, losbuf* B, losctx* C);
+static size_t load(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C);
+static size_t load_x(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C);
+
+#define dumpnext(swap) ((swap) ? dump_x : dump)
+#define loadnext(swap) ((swap) ? load_x : load)
+
+
+/*
+** Returns the shape number of the table on the top, or -1 if it isn't a
+** record. nkeys is set to the key count if the shape is new, otherwise
+** to 0.
+*/
+static lua_Integer shapeof(lua_State* L, losctx* C, size_t* nkeys)
+{
+    int t = lua_gettop(L);
+    size_t n = 0;
+    if (lua_rawlen(L, -1) != 0) {
+        return -1;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 1);
+            return -1;
+        }
+        ++n;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    luaL_checkstack(L, 4, NULL);
+    lua_pushvalue(L, C->shapes);
+    lositer I;
+    hashfirst(L, C, &I, t, 0);
+    while (hashnext(L, C, &I, t)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, -3) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -5);
+        }
+        lua_replace(L, -3);
+    }
+    lua_Integer shape;
+    lua_pushboolean(L, 1);
+    if (lua_rawget(L, -2) == LUA_TNUMBER) {
+        shape = lua_tointeger(L, -1);
+        *nkeys = 0;
+    }
+    else {
+        shape = C->nshape++;
+        lua_pushboolean(L, 1);
+        lua_pushinteger(L, shape);
+        lua_rawset(L, -4);
+        *nkeys = n;
+    }
+    lua_pop(L, 2);
+    return shape;
+}
+
+
+static size_t loadshape(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C, int swap)
+{
+    if (!(C->flags & FLAG_SHAPE)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    luaL_checkstack(L, 4, NULL);
+    uint64_t v;
+    size_t total = 1 + getvarint(E, B + 1, buflen - 1, &v);
+    if ((uint8_t)B[0] == SIGN_SHPDEF) {
+        if (v == 0) {
+            los_throw(E, LOS_ESIGN);
+        }
+        if (v > (buflen - total) / 2) {
+            los_throw(E, LOS_ESRC);
+        }
+        lua_createtable(L, (int)v, 0);
+        for (int i = 1; i <= (int)v; ++i) {
+            size_t consume = loadnext(swap)(E, L, B + total, buflen - total, C);
+            if (consume == 0 || lua_type(L, -1) != LUA_TSTRING) {
+                los_throw(E, LOS_ESIGN);
+            }
+            total += consume;
+            lua_rawseti(L, -2, i);
+        }
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, C->shapes, ++C->nshape);
+    }
+    else {
+        if (v >= (uint64_t)C->nshape) {
+            los_throw(E, LOS_ESIGN);
+        }
+        lua_rawgeti(L, C->shapes, (lua_Integer)v + 1);
+    }
+    int keys = lua_gettop(L);
+    int n = (int)lua_rawlen(L, keys);
+    lua_createtable(L, 0, n);
+    tbldef(L, C);
+    for (int i = 1; i <= n; ++i) {
+        size_t consume = loadnext(swap)(E, L, B + total, buflen - total, C);
+        if (consume == 0) {
+            los_throw(E, LOS_ESIGN);
+        }
+        total += consume;
+        lua_rawgeti(L, keys, i);
+        lua_rotate(L, -2, 1);
+        lua_rawset(L, -3);
+    }
+    lua_remove(L, keys);
+    return total;
+}
+
+
+/*
+** With columnar on, an array of at least COLUMNS_MIN records with the
+** same string keys is written by columns: SIGN_COLUMNS and the length of
+** the block as a varint, then the row count, the key count, and each key
+** followed by its column. A column holding one type is written in a form
+** suited to it: integers as zigzag varint deltas, floats raw, booleans as
+** bits, strings through a dictionary when it halves them; other columns
+** hold plain values. No other option but compact applies inside the
+** block, so it is built on its own before its length is written, and the
+** decoder can take it as one item.
+*/
+#define COLUMNS_MIN 4
+
+#define COL_ANY  0
+#define COL_INT  1
+#define COL_FLT  2
+#define COL_BOOL 3
+#define COL_STR  4
+#define COL_DICT 5
+
+/*
+** Whether len bytes can hold nrows rows of nkeys columns, each taking at
+** least a key, a type and a bit per row. Readers check it before making
+** any row, so a small block can't claim a huge table.
+*/
+#define colsfit(nrows, nkeys, len) \
+    ((nkeys) != 0 && (nrows) / 8 < (len) && (nkeys) <= (len) / (2 + ((nrows) + 7) / 8))
+
+
+/*
+** Returns the key count of the records if the table on the top can be
+** written by columns, otherwise 0.
+*/
+static size_t columnsof(lua_State* L, size_t narr, size_t nrec)
+{
+    if (nrec != 0 || narr < COLUMNS_MIN) {
+        return 0;
+    }
+    luaL_checkstack(L, 4, NULL);
+    int t = lua_gettop(L);
+    size_t nkeys = 0;
+    lua_rawgeti(L, t, 1);
+    if (!lua_istable(L, -1) || lua_rawlen(L, -1) != 0) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 2);
+            return 0;
+        }
+        ++nkeys;
+    }
+    for (size_t i = 2; i <= narr && nkeys > 0; ++i) {
+        lua_rawgeti(L, t, i);
+        size_t n = 0;
+        if (lua_istable(L, -1) && lua_rawlen(L, -1) == 0) {
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                lua_pop(L, 1);
+                ++n;
+            }
+        }
+        if (n != nkeys) {
+            nkeys = 0;
+        }
+        else {
+            lua_pushnil(L);
+            while (lua_next(L, -3)) {
+                lua_pop(L, 1);
+                lua_pushvalue(L, -1);
+                if (lua_rawget(L, -3) == LUA_TNIL) {
+                    nkeys = 0;
+                    lua_pop(L, 2);
+                    break;
+                }
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return nkeys;
+}
+
+
+static void getcell(lua_State* L, int t, size_t i, int key)
+{
+    lua_rawgeti(L, t, i);
+    lua_pushvalue(L, key);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+}
+
+
+static void setcell(lua_State* L, int t, size_t i, int key)
+{
+    lua_rawgeti(L, t, i);
+    lua_pushvalue(L, key);
+    lua_rotate(L, -3, -1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+
+static int coltype(lua_State* L, int t, size_t nrows, int key)
+{
+    int type = COL_ANY;
+    for (size_t i = 1; i <= nrows; ++i) {
+        int ct = COL_ANY;
+        getcell(L, t, i, key);
+        switch (lua_type(L, -1))
+        {
+        case LUA_TNUMBER: {
+            ct = lua_isinteger(L, -1) ? COL_INT : COL_FLT;
+            break;
+        }
+        case LUA_TBOOLEAN: {
+            ct = COL_BOOL;
+            break;
+        }
+        case LUA_TSTRING: {
+            ct = COL_STR;
+            break;
+        }
+        }
+        lua_pop(L, 1);
+        if (ct == COL_ANY || (i > 1 && ct != type)) {
+            return COL_ANY;
+        }
+        type = ct;
+    }
+    return type;
+}
+
+
+static void addcolstr(losbuf* S, lua_State* L)
+{
+    size_t len;
+    const char* s = lua_tolstring(L, -1, &len);
+    losbuf_addvarint(S, len);
+    losbuf_addlstring(S, s, len);
+}
+
+
+static void dumpcolumn(jmp_buf E, lua_State* L, losbuf* S, losctx* P,
+                       int t, size_t nrows, int key, int swap)
+{
+    int type = coltype(L, t, nrows, key);
+    if (type == COL_STR) {
+        lua_newtable(L);
+        int dict = lua_gettop(L);
+        lua_Integer ndict = 0;
+        for (size_t i = 1; i <= nrows; ++i) {
+            getcell(L, t, i, key);
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, dict) == LUA_TNIL) {
+                lua_pop(L, 1);
+                lua_pushvalue(L, -1);
+                lua_pushinteger(L, ndict);
+                lua_rawset(L, dict);
+                lua_rawseti(L, dict, ++ndict);
+            }
+            else {
+                lua_pop(L, 2);
+            }
+        }
+        if ((size_t)ndict * 2 <= nrows) {
+            type = COL_DICT;
+            losbuf_addchar(S, type);
+            losbuf_addvarint(S, ndict);
+            for (lua_Integer j = 1; j <= ndict; ++j) {
+                lua_rawgeti(L, dict, j);
+                addcolstr(S, L);
+                lua_pop(L, 1);
+            }
+            for (size_t i = 1; i <= nrows; ++i) {
+                getcell(L, t, i, key);
+                lua_rawget(L, dict);
+                losbuf_addvarint(S, lua_tointeger(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+        if (type == COL_DICT) {
+            return;
+        }
+    }
+    losbuf_addchar(S, type);
+    switch (type)
+    {
+    case COL_INT: {
+        uint64_t prev = 0;
+        for (size_t i = 1; i <= nrows; ++i) {
+            getcell(L, t, i, key);
+            uint64_t v = (uint64_t)lua_tointeger(L, -1);
+            uint64_t d = v - prev;
+            losbuf_addvarint(S, zigzag(d));
+            prev = v;
+            lua_pop(L, 1);
+        }
+        break;
+    }
+    case COL_FLT: {
+        for (size_t i = 1; i <= nrows; ++i) {
+            getcell(L, t, i, key);
+            double d = lua_tonumber(L, -1);
+            uint64_t u;
+            memcpy(&u, &d, 8);
+            put64(losbuf_prep(S, 8), u, swap);
+            S->n += 8;
+            lua_pop(L, 1);
+        }
+        break;
+    }
+    case COL_BOOL: {
+        uint8_t bits = 0;
+        for (size_t i = 0; i < nrows; ++i) {
+            getcell(L, t, i + 1, key);
+            if (lua_toboolean(L, -1)) {
+                bits |= 1 << (i % 8);
+            }
+            lua_pop(L, 1);
+            if (i % 8 == 7 || i == nrows - 1) {
+                losbuf_addchar(S, bits);
+                bits = 0;
+            }
+        }
+        break;
+    }
+    case COL_STR: {
+        for (size_t i = 1; i <= nrows; ++i) {
+            getcell(L, t, i, key);
+            addcolstr(S, L);
+            lua_pop(L, 1);
+        }
+        break;
+    }
+    default: {
+        for (size_t i = 1; i <= nrows; ++i) {
+            getcell(L, t, i, key);
+            dumpnext(swap)(E, L, S, P);
+            lua_pop(L, 1);
+        }
+    }
+    }
+}
+
+
+/*
+** Builds the block of the table on the top into S, whose box is left on
+** the top, and returns its length.
+*/
+static size_t dumpcolumns(jmp_buf E, lua_State* L, losbuf* S, losctx* C, size_t nkeys, int swap)
+{
+    luaL_checkstack(L, 8, NULL);
+    int t = lua_gettop(L);
+    size_t nrows = lua_rawlen(L, t);
+    losctx P;
+    ctxinit(L, &P, C->flags & (FLAG_COLUMN | FLAG_VARINT | FLAG_TBLSIZ | OPT_CANON));
+    losbuf_init(L, S);
+    losbuf_addvarint(S, nrows);
+    losbuf_addvarint(S, nkeys);
+    lua_rawgeti(L, t, 1);
+    int row = lua_gettop(L);
+    lositer I;
+    hashfirst(L, &P, &I, row, 0);
+    while (hashnext(L, &P, &I, row)) {
+        lua_pop(L, 1);
+        dumpnext(swap)(E, L, S, &P);
+        dumpcolumn(E, L, S, &P, t, nrows, lua_gettop(L), swap);
+    }
+    lua_pop(L, 1);
+    lua_rotate(L, t + 1, 1);
+    lua_settop(L, t + 1);
+    S->box = t + 1;
+    return S->n;
+}
+
+
+static size_t loadcolstr(jmp_buf E, lua_State* L, const char* B, size_t buflen)
+{
+    uint64_t len;
+    size_t n = getvarint(E, B, buflen, &len);
+    checksrclen(buflen - n, len);
+    lua_pushlstring(L, B + n, len);
+    return n + len;
+}
+
+
+static size_t loadcolumn(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* P,
+                         int t, size_t nrows, int key, int swap)
+{
+    checksrclen(buflen, 1);
+    size_t pos = 1;
+    switch (B[0])
+    {
+    case COL_INT: {
+        uint64_t v = 0;
+        for (size_t i = 1; i <= nrows; ++i) {
+            uint64_t z;
+            pos += getvarint(E, B + pos, buflen - pos, &z);
+            v += unzigzag(z);
+            lua_pushinteger(L, (lua_Integer)v);
+            setcell(L, t, i, key);
+        }
+        break;
+    }
+    case COL_FLT: {
+        checksrclen(buflen - pos, nrows * 8);
+        for (size_t i = 1; i <= nrows; ++i) {
+            uint64_t u = get64(B + pos, swap);
+            double d;
+            memcpy(&d, &u, 8);
+            lua_pushnumber(L, d);
+            setcell(L, t, i, key);
+            pos += 8;
+        }
+        break;
+    }
+    case COL_BOOL: {
+        size_t nbytes = (nrows + 7) / 8;
+        checksrclen(buflen - pos, nbytes);
+        for (size_t i = 0; i < nrows; ++i) {
+            lua_pushboolean(L, ((uint8_t)B[pos + i / 8] >> (i % 8)) & 1);
+            setcell(L, t, i + 1, key);
+        }
+        pos += nbytes;
+        break;
+    }
+    case COL_STR: {
+        for (size_t i = 1; i <= nrows; ++i) {
+            pos += loadcolstr(E, L, B + pos, buflen - pos);
+            setcell(L, t, i, key);
+        }
+        break;
+    }
+    case COL_DICT: {
+        uint64_t ndict;
+        pos += getvarint(E, B + pos, buflen - pos, &ndict);
+        if (ndict > buflen - pos) {
+            los_throw(E, LOS_ESRC);
+        }
+        lua_createtable(L, (int)ndict, 0);
+        int dict = lua_gettop(L);
+        for (uint64_t j = 1; j <= ndict; ++j) {
+            pos += loadcolstr(E, L, B + pos, buflen - pos);
+            lua_rawseti(L, dict, (lua_Integer)j);
+        }
+        for (size_t i = 1; i <= nrows; ++i) {
+            uint64_t idx;
+            pos += getvarint(E, B + pos, buflen - pos, &idx);
+            if (idx >= ndict) {
+                los_throw(E, LOS_ESIGN);
+            }
+            lua_rawgeti(L, dict, (lua_Integer)idx + 1);
+            setcell(L, t, i, key);
+        }
+        lua_pop(L, 1);
+        break;
+    }
+    case COL_ANY: {
+        for (size_t i = 1; i <= nrows; ++i) {
+            size_t consume = loadnext(swap)(E, L, B + pos, buflen - pos, P);
+            if (consume == 0) {
+                los_throw(E, LOS_ESIGN);
+            }
+            pos += consume;
+            setcell(L, t, i, key);
+        }
+        break;
+    }
+    default: {
+        los_throw(E, LOS_ESIGN);
+    }
+    }
+    return pos;
+}
+
+
+static size_t loadcolumns(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C, int swap)
+{
+    if (!(C->flags & FLAG_COLUMN)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t len;
+    size_t total = 1 + getvarint(E, B + 1, buflen - 1, &len);
+    checksrclen(buflen - total, len);
+    B += total;
+    luaL_checkstack(L, 8, NULL);
+    losctx P;
+    ctxinit(L, &P, FLAG_COLUMN | FLAG_VARINT);
+    uint64_t nrows;
+    uint64_t nkeys;
+    size_t pos = getvarint(E, B, len, &nrows);
+    pos += getvarint(E, B + pos, len - pos, &nkeys);
+    if (!colsfit(nrows, nkeys, len - pos)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    lua_createtable(L, (int)nrows, 0);
+    int t = lua_gettop(L);
+    for (uint64_t i = 1; i <= nrows; ++i) {
+        lua_createtable(L, 0, (int)nkeys);
+        lua_rawseti(L, t, (lua_Integer)i);
+    }
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        size_t consume = loadnext(swap)(E, L, B + pos, len - pos, &P);
+        if (consume == 0 || lua_type(L, -1) != LUA_TSTRING) {
+            los_throw(E, LOS_ESIGN);
+        }
+        pos += consume;
+        pos += loadcolumn(E, L, B + pos, len - pos, &P, t, nrows, t + 1, swap);
+        lua_pop(L, 1);
+    }
+    if (pos != len) {
+        los_throw(E, LOS_ESIGN);
+    }
+    return total + len;
+}
+
+/*
+** Arrays of at least ARRAY_MIN numbers or booleans of one kind, without
+** other keys, are written packed: SIGN_ARRAY, the element type, the count
+** as a varint and the elements back to back, integers in the smallest
+** width holding them all, booleans as bits. They are packed and unpacked
+** ARRAY_CHUNK elements at a time, so byte swapping for the other endian
+** runs as a plain loop over a chunk.
+*/
+#define ARRAY_MIN   8
+#define ARRAY_CHUNK 256
+
+#define ARR_F64  1
+#define ARR_I8   2
+#define ARR_I16  3
+#define ARR_I32  4
+#define ARR_I64  5
+#define ARR_BOOL 6
+
+static const uint8_t arrwidth[] = {0, 8, 1, 2, 4, 8, 0};
+
+#define arraylen(n, type) \
+    ((type) == ARR_BOOL ? ((n) + 7) / 8 : (n) * arrwidth[type])
+
+
+static int arrtype(lua_State* L, size_t narr)
+{
+    int type = 0;
+    lua_Integer min = 0;
+    lua_Integer max = 0;
+    for (size_t i = 1; i <= narr; ++i) {
+        int et = 0;
+        switch (lua_rawgeti(L, -1, i))
+        {
+        case LUA_TNUMBER: {
+            if (lua_isinteger(L, -1)) {
+                lua_Integer v = lua_tointeger(L, -1);
+                min = (i == 1 || v < min) ? v : min;
+                max = (i == 1 || v > max) ? v : max;
+                et = ARR_I64;
+            }
+            else {
+                et = ARR_F64;
+            }
+            break;
+        }
+        case LUA_TBOOLEAN: {
+            et = ARR_BOOL;
+            break;
+        }
+        }
+        lua_pop(L, 1);
+        if (et == 0 || (i > 1 && et != type)) {
+            return 0;
+        }
+        type = et;
+    }
+    if (type == ARR_I64) {
+        if (INT8_MIN <= min && max <= INT8_MAX) {
+            type = ARR_I8;
+        }
+        else if (INT16_MIN <= min && max <= INT16_MAX) {
+            type = ARR_I16;
+        }
+        else if (INT32_MIN <= min && max <= INT32_MAX) {
+            type = ARR_I32;
+        }
+    }
+    return type;
+}
+
+
+static void packchunk(lua_State* L, char* p, size_t first, size_t n, int type, int swap)
+{
+    uint64_t v[ARRAY_CHUNK];
+    if (type == ARR_BOOL) {
+        memset(p, 0, (n + 7) / 8);
+        for (size_t i = 0; i < n; ++i) {
+            lua_rawgeti(L, -1, first + i);
+            p[i / 8] |= lua_toboolean(L, -1) << (i % 8);
+            lua_pop(L, 1);
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        lua_rawgeti(L, -1, first + i);
+        if (type == ARR_F64) {
+            double d = lua_tonumber(L, -1);
+            memcpy(&v[i], &d, 8);
+        }
+        else {
+            v[i] = (uint64_t)lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    switch (arrwidth[type])
+    {
+    case 1: {
+        for (size_t i = 0; i < n; ++i) {
+            p[i] = (char)v[i];
+        }
+        break;
+    }
+    case 2: {
+        uint16_t t[ARRAY_CHUNK];
+        for (size_t i = 0; i < n; ++i) {
+            t[i] = swap ? bswap16(v[i]) : (uint16_t)v[i];
+        }
+        memcpy(p, t, n * 2);
+        break;
+    }
+    case 4: {
+        uint32_t t[ARRAY_CHUNK];
+        for (size_t i = 0; i < n; ++i) {
+            t[i] = swap ? bswap32(v[i]) : (uint32_t)v[i];
+        }
+        memcpy(p, t, n * 4);
+        break;
+    }
+    default: {
+        if (swap) {
+            for (size_t i = 0; i < n; ++i) {
+                v[i] = bswap64(v[i]);
+            }
+        }
+        memcpy(p, v, n * 8);
+    }
+    }
+}
+
+
+static void unpackchunk(lua_State* L, const char* p, size_t first, size_t n, int type, int swap)
+{
+    uint64_t v[ARRAY_CHUNK];
+    if (type == ARR_BOOL) {
+        for (size_t i = 0; i < n; ++i) {
+            lua_pushboolean(L, ((uint8_t)p[i / 8] >> (i % 8)) & 1);
+            lua_rawseti(L, -2, first + i);
+        }
+        return;
+    }
+    switch (arrwidth[type])
+    {
+    case 1: {
+        for (size_t i = 0; i < n; ++i) {
+            v[i] = (uint64_t)(int8_t)p[i];
+        }
+        break;
+    }
+    case 2: {
+        uint16_t t[ARRAY_CHUNK];
+        memcpy(t, p, n * 2);
+        for (size_t i = 0; i < n; ++i) {
+            v[i] = (uint64_t)(int16_t)(swap ? bswap16(t[i]) : t[i]);
+        }
+        break;
+    }
+    case 4: {
+        uint32_t t[ARRAY_CHUNK];
+        memcpy(t, p, n * 4);
+        for (size_t i = 0; i < n; ++i) {
+            v[i] = (uint64_t)(int32_t)(swap ? bswap32(t[i]) : t[i]);
+        }
+        break;
+    }
+    default: {
+        memcpy(v, p, n * 8);
+        if (swap) {
+            for (size_t i = 0; i < n; ++i) {
+                v[i] = bswap64(v[i]);
+            }
+        }
+    }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (type == ARR_F64) {
+            double d;
+            memcpy(&d, &v[i], 8);
+            lua_pushnumber(L, d);
+        }
+        else {
+            lua_pushinteger(L, (lua_Integer)v[i]);
+        }
+        lua_rawseti(L, -2, first + i);
+    }
+}
+
+
+static size_t loadarray(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C, int swap)
+{
+    checksrclen(buflen, 2);
+    int type = (uint8_t)B[1];
+    if (type < ARR_F64 || type > ARR_BOOL) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t narr;
+    size_t total = 2 + getvarint(E, B + 2, buflen - 2, &narr);
+    if (narr > (buflen - total) * 8 || arraylen(narr, type) > buflen - total) {
+        los_throw(E, LOS_ESRC);
+    }
+    if (narr > INT_MAX) {
+        los_throw(E, LOS_ESIGN);
+    }
+    luaL_checkstack(L, 2, NULL);
+    lua_createtable(L, (int)narr, 0);
+    tbldef(L, C);
+    for (size_t i = 1; i <= narr; i += ARRAY_CHUNK) {
+        size_t n = narr - i + 1 < ARRAY_CHUNK ? narr - i + 1 : ARRAY_CHUNK;
+        unpackchunk(L, B + total, i, n, type, swap);
+        total += arraylen(n, type);
+    }
+    return total;
+}
+
+
+static size_t dumpbuf(jmp_buf E, lua_State* L, losbuf* B, losctx* C);
+static size_t dumpbuf_x(jmp_buf E, lua_State* L, losbuf* B, losctx* C);
+static size_t dumplen(jmp_buf E, lua_State* L, losbuf* B, losctx* C);
+
+
+los_inline size_t encodenext(jmp_buf E, lua_State* L, losbuf* B, losctx* C, int swap, int sink)
+{
+    if (sink == SINK_COUNT) {
+        return dumplen(E, L, B, C);
+    }
+    if (sink == SINK_FIXED) {
+        return swap ? dumpbuf_x(E, L, B, C) : dumpbuf(E, L, B, C);
+    }
+    return swap ? dump_x(E, L, B, C) : dump(E, L, B, C);
+}
+
+
+los_inline size_t sinkvarint(losbuf* B, int sign, uint64_t v, int sink)
+{
+    if (sink == SINK_COUNT) {
+        size_t size = 1 + varintlen(v);
+        B->n += size;
+        return size;
+    }
+    char p[1 + VARINT_MAXLEN];
+    p[0] = (char)sign;
+    size_t size = 1 + putvarint(p + 1, v);
+    sinkmem(B, p, size, sink);
+    return size;
+}
+
+
+/*
+** With index on, a table of at least INDEX_MIN items is written with a
+** footer for random access: SIGN_INDEX and the length of the block as a
+** varint, then the plain table and the footer. The footer holds the
+** offset of each array item, then a hash, key offset and value offset
+** per hash item sorted by hash, then the array and hash counts, all as
+** 4 byte integers in the target endian, offsets counting from the
+** table's SIGN_TBLBEG. A reader finds t[i] straight away and t[k] by
+** binary search on the hash of k, without touching the items between.
+**
+** The block is written in place, so its length is counted first. While
+** counting, the lengths of the blocks nested in it are recorded in the
+** order they are met, and taken back in that order while writing, so a
+** block is counted once however deep it is. Counting would register
+** strings, tables and shapes, so with dedup, refs or shapes on a block
+** is built in a buffer of its own and copied instead.
+*/
+#define INDEX_MIN 16
+
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+typedef struct losindex
+{
+    uint32_t hash;
+    uint32_t key;
+    uint32_t val;
+} losindex;
+
+
+static uint32_t hashbytes(uint32_t h, const char* s, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (uint8_t)s[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+
+/*
+** Hash of the key at idx, independent of the endian and of how the key
+** is encoded. Floats with an integer value hash as that integer, the
+** way Lua indexes them.
+*/
+static uint32_t keyhash(lua_State* L, int idx)
+{
+    char b[9];
+    switch (lua_type(L, idx))
+    {
+    case LUA_TSTRING: {
+        size_t len;
+        const char* s = lua_tolstring(L, idx, &len);
+        return hashbytes(FNV_BASIS, s, len);
+    }
+    case LUA_TNUMBER: {
+        int isint;
+        uint64_t u = (uint64_t)lua_tointegerx(L, idx, &isint);
+        b[0] = 'i';
+        if (!isint) {
+            double d = lua_tonumber(L, idx);
+            memcpy(&u, &d, 8);
+            b[0] = 'f';
+        }
+        for (int i = 0; i < 8; ++i) {
+            b[1 + i] = (char)(u >> (8 * i));
+        }
+        return hashbytes(FNV_BASIS, b, 9);
+    }
+    case LUA_TBOOLEAN: {
+        b[0] = 'b';
+        b[1] = (char)lua_toboolean(L, idx);
+        return hashbytes(FNV_BASIS, b, 2);
+    }
+    }
+    return 0;
+}
+
+
+static int indexcmp(const void* a, const void* b)
+{
+    const losindex* x = a;
+    const losindex* y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+
+#define indexoff(E, n) \
+    ((n) > UINT32_MAX ? (los_throw(E, LOS_ESTR), 0) : (uint32_t)(n))
+
+#define INDEX_REFS (FLAG_STRREF | FLAG_TBLREF | FLAG_SHAPE)
+
+
+/*
+** Writes the table at t from SIGN_TBLBEG to the end of its footer into B,
+** returning the length. Counting, it needs no offsets.
+*/
+static size_t indexbody(jmp_buf E, lua_State* L, losbuf* B, losctx* C, int t,
+                        size_t narr, size_t nrec, int swap, int sink)
+{
+    luaL_checkstack(L, 6, NULL);
+    int top = lua_gettop(L);
+    losbuf F;
+    uint32_t* offs = NULL;
+    losindex* ents = NULL;
+    if (sink != SINK_COUNT) {
+        losbuf_init(L, &F);
+        offs = (uint32_t*)losbuf_prep(&F, narr * 4 + nrec * sizeof(losindex));
+        ents = (losindex*)(offs + narr);
+    }
+    sinkchar(B, SIGN_TBLBEG, sink);
+    sinkchar(B, SIGN_TBLSIZ, sink);
+    size_t size = 2;
+    lua_pushinteger(L, narr);
+    size += encodenext(E, L, B, C, swap, sink);
+    lua_pushinteger(L, nrec);
+    size += encodenext(E, L, B, C, swap, sink);
+    lua_pop(L, 2);
+    for (size_t i = 1; i <= narr; ++i) {
+        uint32_t off = indexoff(E, size);
+        if (offs) {
+            offs[i - 1] = off;
+        }
+        lua_rawgeti(L, t, i);
+        size += encodenext(E, L, B, C, swap, sink);
+        lua_pop(L, 1);
+    }
+    sinkchar(B, SIGN_TBLSEP, sink);
+    ++size;
+    size_t n = 0;
+    lositer I;
+    hashfirst(L, C, &I, t, narr);
+    while (hashnext(L, C, &I, t)) {
+        if (isarraykey(L, narr)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        uint32_t val = indexoff(E, size);
+        size += encodenext(E, L, B, C, swap, sink);
+        lua_pop(L, 1);
+        uint32_t key = indexoff(E, size);
+        if (ents) {
+            ents[n].val = val;
+            ents[n].key = key;
+            ents[n].hash = keyhash(L, -1);
+        }
+        size += encodenext(E, L, B, C, swap, sink);
+        ++n;
+    }
+    sinkchar(B, SIGN_TBLEND, sink);
+    ++size;
+    size_t footer = narr * 4 + n * 12 + 8;
+    if (sink == SINK_COUNT) {
+        B->n += footer;
+        return size + footer;
+    }
+    qsort(ents, n, sizeof(losindex), indexcmp);
+    char p[12];
+    for (size_t i = 0; i < narr; ++i) {
+        put32(p, offs[i], swap);
+        sinkmem(B, p, 4, sink);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        put32(p, ents[i].hash, swap);
+        put32(p + 4, ents[i].key, swap);
+        put32(p + 8, ents[i].val, swap);
+        sinkmem(B, p, 12, sink);
+    }
+    put32(p, (uint32_t)narr, swap);
+    put32(p + 4, (uint32_t)n, swap);
+    sinkmem(B, p, 8, sink);
+    lua_settop(L, top);
+    return size + footer;
+}
+
+
+static size_t indexlen(losctx* C, size_t k)
+{
+    size_t len;
+    memcpy(&len, C->lens->b + k * sizeof(size_t), sizeof(size_t));
+    return len;
+}
+
+
+/*
+** Writes the table on the top as an index block into B, returning its
+** length.
+*/
+static size_t dumpindex(jmp_buf E, lua_State* L, losbuf* B, losctx* C,
+                        size_t narr, size_t nrec, int swap, int sink)
+{
+    int t = lua_gettop(L);
+    if (sink == SINK_COUNT) {
+        losbuf* Q = C->lens;
+        size_t k = 0;
+        if (Q) {
+            k = Q->n;
+            losbuf_prep(Q, sizeof(size_t));
+            Q->n += sizeof(size_t);
+        }
+        size_t len = indexbody(E, L, B, C, t, narr, nrec, swap, sink);
+        if (Q) {
+            memcpy(Q->b + k, &len, sizeof(size_t));
+        }
+        return sinkvarint(B, SIGN_INDEX, len, sink) + len;
+    }
+    if (C->flags & INDEX_REFS) {
+        losbuf S;
+        losbuf_init(L, &S);
+        size_t len = indexbody(E, L, &S, C, t, narr, nrec, swap, SINK_BUF);
+        size_t size = sinkvarint(B, SIGN_INDEX, len, sink);
+        sinkmem(B, S.b, len, sink);
+        lua_settop(L, t);
+        return size + len;
+    }
+    losbuf Q;
+    int outer = C->lens == NULL;
+    if (outer) {
+        losbuf_init(L, &Q);
+        C->lens = &Q;
+        C->ilen = 0;
+        losbuf N;
+        losbuf_initcount(L, &N);
+        lua_pushvalue(L, t);
+        dumpindex(E, L, &N, C, narr, nrec, swap, SINK_COUNT);
+        lua_settop(L, t + 1);
+    }
+    size_t len = indexlen(C, C->ilen++);
+    size_t size = sinkvarint(B, SIGN_INDEX, len, sink);
+    size += indexbody(E, L, B, C, t, narr, nrec, swap, sink);
+    if (outer) {
+        C->lens = NULL;
+        lua_settop(L, t);
+    }
+    return size;
+}
+
+
+static size_t loadindex(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C, int swap)
+{
+    if (!(C->flags & FLAG_INDEX)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t len;
+    size_t n = 1 + getvarint(E, B + 1, buflen - 1, &len);
+    checksrclen(buflen - n, len);
+    if (len == 0 || (uint8_t)B[n] != SIGN_TBLBEG) {
+        los_throw(E, LOS_ESIGN);
+    }
+    loadnext(swap)(E, L, B + n, (size_t)len, C);
+    return n + (size_t)len;
+}
+
+
+/*
+** Encodes the value on top of the stack into B, returning its length.
+** Every argument but C is a constant in the wrappers below, so this is
+** the only place where encodings are written.
+*/
+los_inline size_t encode(jmp_buf E, lua_State* L, losbuf* B, losctx* C, int swap, int sink)
+{
+    int type = lua_type(L, -1);
+    switch (type)
+    {
+    case LUA_TNIL: {
+        sinkchar(B, SIGN_NIL, sink);
+        return 1;
+    }
+    case LUA_TBOOLEAN: {
+        sinkchar(B, lua_toboolean(L, -1) ? SIGN_TRUE : SIGN_FALSE, sink);
+        return 1;
+    }
+    case LUA_TNUMBER: {
+        char p[9];
+        if (lua_isinteger(L, -1)) {
+            int64_t v = lua_tointeger(L, -1);
+            if ((C->flags & FLAG_VARINT) && isvint(v)) {
+                return sinkvarint(B, SIGN_VINT, zigzag((uint64_t)v), sink);
+            }
+            if (isshrint(v)) {
+                sinkchar(B, (int8_t)v, sink);
+                return 1;
+            }
+            else if (INT8_MIN <= v && v <= INT8_MAX) {
+                p[0] = (char)SIGN_INT1;
+                p[1] = (char)(int8_t)v;
+                sinkmem(B, p, 2, sink);
+                return 2;
+            }
+            else if (INT16_MIN <= v && v <= INT16_MAX) {
+                p[0] = (char)SIGN_INT2;
+                put16(p + 1, (uint16_t)v, swap);
+                sinkmem(B, p, 3, sink);
+                return 3;
+            }
+            else if (INT32_MIN <= v && v <= INT32_MAX) {
+                p[0] = (char)SIGN_INT4;
+                put32(p + 1, (uint32_t)v, swap);
+                sinkmem(B, p, 5, sink);
+                return 5;
+            }
+            else {
+                p[0] = (char)SIGN_INT8;
+                put64(p + 1, (uint64_t)v, swap);
+                sinkmem(B, p, 9, sink);
+                return 9;
+            }
+        }
+        else {
+            double v = lua_tonumber(L, -1);
+            uint64_t u;
+            memcpy(&u, &v, 8);
+            p[0] = (char)SIGN_FLT;
+            put64(p + 1, u, swap);
+            sinkmem(B, p, 9, sink);
+            return 9;
+        }
+    }
+    case LUA_TSTRING: {
+        size_t len;
+        const char* s = lua_tolstring(L, -1, &len);
+        if ((C->flags & FLAG_STRREF) && len >= STRREF_MIN) {
+            lua_Integer ref = strref(L, C);
+            if (ref >= 0) {
+                return sinkvarint(B, SIGN_STRREF, ref, sink);
+            }
+        }
+        size_t size;
+        char p[5];
+        if ((C->flags & FLAG_VARINT) && len > 31) {
+            size = sinkvarint(B, SIGN_VSTR, len, sink);
+        }
+        else if (len <= 31) {
+            sinkchar(B, SIGN_SHRSTR | (int)len, sink);
+            size = 1;
+        }
+        else if (len <= UINT8_MAX) {
+            p[0] = (char)SIGN_STR1;
+            p[1] = (char)(uint8_t)len;
+            size = 2;
+            sinkmem(B, p, size, sink);
+        }
+        else if (len <= UINT16_MAX) {
+            p[0] = (char)SIGN_STR2;
+            put16(p + 1, (uint16_t)len, swap);
+            size = 3;
+            sinkmem(B, p, size, sink);
+        }
+        else if (len <= UINT32_MAX) {
+            p[0] = (char)SIGN_STR4;
+            put32(p + 1, (uint32_t)len, swap);
+            size = 5;
+            sinkmem(B, p, size, sink);
+        }
+        else {
+            los_throw(E, LOS_ESTR);
+        }
+        sinkmem(B, s, len, sink);
+        return size + len;
+    }
+    case LUA_TTABLE: {
+        luaL_checkstack(L, 3, NULL);
+        int t = lua_gettop(L);
+        lositer I;
+        if (C->flags & FLAG_TBLREF) {
+            lua_Integer ref = tblref(L, C);
+            if (ref >= 0) {
+                return sinkvarint(B, SIGN_TBLREF, ref, sink);
+            }
+        }
+        if (C->flags & FLAG_SHAPE) {
+            size_t nkeys;
+            lua_Integer shape = shapeof(L, C, &nkeys);
+            if (shape >= 0) {
+                size_t size = nkeys ? sinkvarint(B, SIGN_SHPDEF, nkeys, sink)
+                                    : sinkvarint(B, SIGN_SHAPE, (uint64_t)shape, sink);
+                if (nkeys) {
+                    hashfirst(L, C, &I, t, 0);
+                    while (hashnext(L, C, &I, t)) {
+                        lua_pop(L, 1);
+                        size += encodenext(E, L, B, C, swap, sink);
+                    }
+                }
+                hashfirst(L, C, &I, t, 0);
+                while (hashnext(L, C, &I, t)) {
+                    size += encodenext(E, L, B, C, swap, sink);
+                    lua_pop(L, 1);
+                }
+                return size;
+            }
+        }
+        size_t narr = tablelen(L, C);
+        size_t nrec = hashlen(L, narr);
+        if (C->flags & FLAG_COLUMN) {
+            size_t nkeys = columnsof(L, narr, nrec);
+            if (nkeys > 0) {
+                losbuf S;
+                size_t len = dumpcolumns(E, L, &S, C, nkeys, swap);
+                size_t size = sinkvarint(B, SIGN_COLUMNS, len, sink);
+                sinkmem(B, S.b, len, sink);
+                lua_pop(L, 1);
+                return size + len;
+            }
+        }
+        if (nrec == 0 && narr >= ARRAY_MIN) {
+            int type = arrtype(L, narr);
+            if (type != 0) {
+                char p[2 + VARINT_MAXLEN];
+                p[0] = (char)SIGN_ARRAY;
+                p[1] = (char)type;
+                size_t size = 2 + putvarint(p + 2, narr);
+                sinkmem(B, p, size, sink);
+                if (sink == SINK_COUNT) {
+                    B->n += arraylen(narr, type);
+                    return size + arraylen(narr, type);
+                }
+                for (size_t i = 1; i <= narr; i += ARRAY_CHUNK) {
+                    size_t n = narr - i + 1 < ARRAY_CHUNK ? narr - i + 1 : ARRAY_CHUNK;
+                    size_t len = arraylen(n, type);
+                    packchunk(L, sinkprep(B, len, sink), i, n, type, swap);
+                    B->n += len;
+                    size += len;
+                }
+                return size;
+            }
+        }
+        if ((C->flags & FLAG_INDEX) && narr + nrec >= INDEX_MIN) {
+            return dumpindex(E, L, B, C, narr, nrec, swap, sink);
+        }
+        sinkchar(B, SIGN_TBLBEG, sink);
+        size_t size = 1;
+        if ((C->flags & FLAG_TBLSIZ) && narr + nrec >= TBLSIZ_MIN) {
+            sinkchar(B, SIGN_TBLSIZ, sink);
+            ++size;
+            lua_pushinteger(L, narr);
+            size += encodenext(E, L, B, C, swap, sink);
+            lua_pushinteger(L, nrec);
+            size += encodenext(E, L, B, C, swap, sink);
+            lua_pop(L, 2);
+        }
+        for (size_t i = 1; i <= narr; ++i) {
+            lua_rawgeti(L, -1, i);
+            size += encodenext(E, L, B, C, swap, sink);
+            lua_pop(L, 1);
+        }
+        sinkchar(B, SIGN_TBLSEP, sink);
+        ++size;
+        hashfirst(L, C, &I, t, narr);
+        while (hashnext(L, C, &I, t)) {
+            if (isarraykey(L, narr)) {
+                lua_pop(L, 1);
+                continue;
+            }
+            size += encodenext(E, L, B, C, swap, sink);
+            lua_pop(L, 1);
+            size += encodenext(E, L, B, C, swap, sink);
+        }
+        sinkchar(B, SIGN_TBLEND, sink);
+        ++size;
+        return size;
+    }
+    default: {
+        los_throw(E, LOS_ETYPE);
+    }
+    }
+    return 0;
+}
+
+
+static size_t dump(jmp_buf E, lua_State* L, losbuf* B, losctx* C)
+{
+    return encode(E, L, B, C, 0, SINK_BUF);
+}
+
+
+static size_t dump_x(jmp_buf E, lua_State* L, losbuf* B, losctx* C)
+{
+    return encode(E, L, B, C, 1, SINK_BUF);
+}
+
+
+static size_t dumpbuf(jmp_buf E, lua_State* L, losbuf* B, losctx* C)
+{
+    return encode(E, L, B, C, 0, SINK_FIXED);
+}
+
+
+static size_t dumpbuf_x(jmp_buf E, lua_State* L, losbuf* B, losctx* C)
+{
+    return encode(E, L, B, C, 1, SINK_FIXED);
+}
+
+
+/*
+** The length doesn't depend on the byte order.
+*/
+static size_t dumplen(jmp_buf E, lua_State* L, losbuf* B, losctx* C)
+{
+    return encode(E, L, B, C, 0, SINK_COUNT);
+}
+
+
+static int tblsize(jmp_buf E, lua_State* L, size_t consume, size_t limit)
+{
+    if (consume == 0 || !lua_isinteger(L, -1)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    lua_Integer n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (n < 0) {
+        los_throw(E, LOS_ESIGN);
+    }
+    if ((lua_Unsigned)n > limit) {
+        n = (lua_Integer)limit;
+    }
+    return n > INT_MAX ? INT_MAX : (int)n;
+}
+
+
+/*
+** Rejects the key on the top if lua_rawset would raise an error on it.
+*/
+static void checkkey(jmp_buf E, lua_State* L)
+{
+    int bad = lua_isnil(L, -1);
+    if (lua_type(L, -1) == LUA_TNUMBER && !lua_isinteger(L, -1)) {
+        lua_Number d = lua_tonumber(L, -1);
+        bad = d != d;
+    }
+    if (bad) {
+        los_throw(E, LOS_ESIGN);
+    }
+}
+
+
+/*
+** Decodes one value from B onto the stack, returning its length, or 0 at
+** the end of a table part. Specialized on the byte order like encode.
+*/
+los_inline size_t decode(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C, int swap)
+{
+    if (buflen == 0) {
+        los_throw(E, LOS_ESRC);
+    }
+    uint8_t c = (uint8_t)B[0];
+    if (IS_SHRINT(c)) {
+        lua_pushinteger(L, (int8_t)c);
+        return 1;
+    }
+    if (IS_SHRSTR(c)) {
+        size_t len = c & ~MASK_SHRSTR;
+        checksrclen(buflen, 1 + len);
+        lua_pushlstring(L, B + 1, len);
+        strdef(L, C, len);
+        return 1 + len;
+    }
+    switch (c)
+    {
+    case SIGN_NIL: {
+        lua_pushnil(L);
+        return 1;
+    }
+    case SIGN_FALSE: {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    case SIGN_TRUE: {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    case SIGN_INT1: {
+        checksrclen(buflen, 2);
+        lua_pushinteger(L, (int8_t)B[1]);
+        return 2;
+    }
+    case SIGN_INT2: {
+        checksrclen(buflen, 3);
+        lua_pushinteger(L, (int16_t)get16(B + 1, swap));
+        return 3;
+    }
+    case SIGN_INT4: {
+        checksrclen(buflen, 5);
+        lua_pushinteger(L, (int32_t)get32(B + 1, swap));
+        return 5;
+    }
+    case SIGN_INT8: {
+        checksrclen(buflen, 9);
+        lua_pushinteger(L, (lua_Integer)get64(B + 1, swap));
+        return 9;
+    }
+    case SIGN_STR1:
+    case SIGN_STR2:
+    case SIGN_STR4: {
+        size_t n = c == SIGN_STR1 ? 2 : c == SIGN_STR2 ? 3 : 5;
+        checksrclen(buflen, n);
+        size_t len = c == SIGN_STR1 ? (uint8_t)B[1]
+                   : c == SIGN_STR2 ? get16(B + 1, swap)
+                   : get32(B + 1, swap);
+        checksrclen(buflen - n, len);
+        lua_pushlstring(L, B + n, len);
+        strdef(L, C, len);
+        return n + len;
+    }
+    case SIGN_FLT: {
+        checksrclen(buflen, 9);
+        uint64_t u = get64(B + 1, swap);
+        double v;
+        memcpy(&v, &u, 8);
+        lua_pushnumber(L, v);
+        return 9;
+    }
+    case SIGN_TBLBEG: {
+        luaL_checkstack(L, 3, NULL);
+        size_t total = 1;
+        size_t consume = 0;
+        int narr = 0;
+        int nrec = 0;
+        if (buflen > 1 && (uint8_t)B[1] == SIGN_TBLSIZ) {
+            ++total;
+            consume = loadnext(swap)(E, L, B + total, buflen - total, C);
+            total += consume;
+            narr = tblsize(E, L, consume, buflen - total);
+            consume = loadnext(swap)(E, L, B + total, buflen - total, C);
+            total += consume;
+            nrec = tblsize(E, L, consume, (buflen - total) / 2);
+        }
+        lua_createtable(L, narr, nrec);
+        tbldef(L, C);
+        int i = 1;
+        while (consume = loadnext(swap)(E, L, B + total, buflen - total, C)) {
+            lua_rawseti(L, -2, i++);
+            total += consume;
+        }
+        ++total;
+        while (consume = loadnext(swap)(E, L, B + total, buflen - total, C)) {
+            total += consume;
+            consume = loadnext(swap)(E, L, B + total, buflen - total, C);
+            if (consume == 0) {
+                los_throw(E, LOS_ESRC);
+            }
+            total += consume;
+            checkkey(E, L);
+            lua_rotate(L, -2, 1);
+            lua_rawset(L, -3);
+        }
+        ++total;
+        return total;
+    }
+    case SIGN_STRREF: {
+        return loadstrref(E, L, B, buflen, C);
+    }
+    case SIGN_TBLREF: {
+        return loadtblref(E, L, B, buflen, C);
+    }
+    case SIGN_SHAPE:
+    case SIGN_SHPDEF: {
+        return loadshape(E, L, B, buflen, C, swap);
+    }
+    case SIGN_COLUMNS: {
+        return loadcolumns(E, L, B, buflen, C, swap);
+    }
+    case SIGN_VINT: {
+        uint64_t z;
+        size_t n = 1 + getvarint(E, B + 1, buflen - 1, &z);
+        lua_pushinteger(L, (lua_Integer)unzigzag(z));
+        return n;
+    }
+    case SIGN_VSTR: {
+        uint64_t len;
+        size_t n = 1 + getvarint(E, B + 1, buflen - 1, &len);
+        checksrclen(buflen - n, len);
+        lua_pushlstring(L, B + n, len);
+        strdef(L, C, len);
+        return n + len;
+    }
+    case SIGN_ARRAY: {
+        return loadarray(E, L, B, buflen, C, swap);
+    }
+    case SIGN_INDEX: {
+        return loadindex(E, L, B, buflen, C, swap);
+    }
+    case SIGN_TBLSEP:
+    case SIGN_TBLEND: {
+        return 0;
+    }
+    default: {
+        los_throw(E, LOS_ESIGN);
+    }
+    }
+    return 0;
+}
+
+
+static size_t load(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C)
+{
+    return decode(E, L, B, buflen, C, 0);
+}
+
+
+static size_t load_x(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C)
+{
+    return decode(E, L, B, buflen, C, 1);
+}
+
+
+/*
+** Block compression. With compress on, the encoded object following the
+** header is cut into blocks of at most LZ_BLOCK bytes, each written as a
+** frame: a varint raw length, a varint compressed length and the data,
+** stored as is when the compressed length is 0. A raw length of 0 ends
+** the object. Blocks are compressed as the encoder flushes them and
+** inflated one at a time into the incremental decoder, so neither side
+** ever holds the whole uncompressed object.
+**
+** The block format is LZ77 in the style of LZ4: a token whose high
+** nibble is the literal count and low nibble the match length minus
+** LZ_MINMATCH, 15 meaning more length bytes follow, then the literals and
+** a little endian 2 byte offset. The last sequence has literals only.
+*/
+#define LZ_BLOCK    65536
+#define LZ_HASHBITS 13
+#define LZ_MINMATCH 4
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+#define lzhash(v) ((uint32_t)((v) * 2654435761u) >> (32 - LZ_HASHBITS))
+
+
+static uint32_t lzload32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+static uint8_t* lzputlen(uint8_t* d, size_t n)
+{
+    while (n >= 255) {
+        *d++ = 255;
+        n -= 255;
+    }
+    *d++ = (uint8_t)n;
+    return d;
+}
+
+
+static uint8_t* lzputseq(uint8_t* d, const uint8_t* lit, size_t nlit, size_t off, size_t mlen)
+{
+    uint8_t* token = d++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) {
+        d = lzputlen(d, nlit - 15);
+    }
+    memcpy(d, lit, nlit);
+    d += nlit;
+    if (mlen > 0) {
+        mlen -= LZ_MINMATCH;
+        *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+        *d++ = (uint8_t)off;
+        *d++ = (uint8_t)(off >> 8);
+        if (mlen >= 15) {
+            d = lzputlen(d, mlen - 15);
+        }
+    }
+    return d;
+}
+
+
+/*
+** Compresses n <= LZ_BLOCK bytes into dst, which has room for
+** LZ_BOUND(n), and returns the compressed length.
+*/
+static size_t lzcompress(const char* src, size_t n, char* dst)
+{
+    uint16_t tab[1 << LZ_HASHBITS];
+    memset(tab, 0, sizeof(tab));
+    const uint8_t* s = (const uint8_t*)src;
+    uint8_t* d = (uint8_t*)dst;
+    size_t anchor = 0;
+    size_t ip = 1;
+    while (n >= LZ_MINMATCH && ip <= n - LZ_MINMATCH) {
+        uint32_t v = lzload32(s + ip);
+        uint32_t h = lzhash(v);
+        size_t ref = tab[h];
+        tab[h] = (uint16_t)ip;
+        if (lzload32(s + ref) != v) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        size_t mlen = LZ_MINMATCH;
+        while (ip + mlen < n && s[ref + mlen] == s[ip + mlen]) {
+            ++mlen;
+        }
+        d = lzputseq(d, s + anchor, ip - anchor, ip - ref, mlen);
+        ip += mlen;
+        anchor = ip;
+        if (ip >= 2 && ip <= n - LZ_MINMATCH) {
+            tab[lzhash(lzload32(s + ip - 2))] = (uint16_t)(ip - 2);
+        }
+    }
+    d = lzputseq(d, s + anchor, n - anchor, 0, 0);
+    return (size_t)(d - (uint8_t*)dst);
+}
+
+
+static size_t lzgetlen(jmp_buf E, const uint8_t** p, const uint8_t* end)
+{
+    size_t n = 0;
+    uint8_t c;
+    do {
+        if (*p == end || n > LZ_BLOCK) {
+            los_throw(E, LOS_ESIGN);
+        }
+        c = *(*p)++;
+        n += c;
+    } while (c == 255);
+    return n;
+}
+
+
+static void lzinflate(jmp_buf E, const char* src, size_t len, char* dst, size_t rawlen)
+{
+    const uint8_t* s = (const uint8_t*)src;
+    const uint8_t* end = s + len;
+    uint8_t* d = (uint8_t*)dst;
+    size_t op = 0;
+    for (;;) {
+        if (s == end) {
+            los_throw(E, LOS_ESIGN);
+        }
+        unsigned token = *s++;
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            nlit += lzgetlen(E, &s, end);
+        }
+        if (nlit > (size_t)(end - s) || nlit > rawlen - op) {
+            los_throw(E, LOS_ESIGN);
+        }
+        memcpy(d + op, s, nlit);
+        s += nlit;
+        op += nlit;
+        if (s == end) {
+            break;
+        }
+        if (end - s < 2) {
+            los_throw(E, LOS_ESIGN);
+        }
+        size_t off = s[0] | (size_t)s[1] << 8;
+        s += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            mlen += lzgetlen(E, &s, end);
+        }
+        mlen += LZ_MINMATCH;
+        if (off == 0 || off > op || mlen > rawlen - op) {
+            los_throw(E, LOS_ESIGN);
+        }
+        const uint8_t* m = d + op - off;
+        if (off >= mlen) {
+            memcpy(d + op, m, mlen);
+        }
+        else {
+            for (size_t i = 0; i < mlen; ++i) {
+                d[op + i] = m[i];
+            }
+        }
+        op += mlen;
+    }
+    if (op != rawlen) {
+        los_throw(E, LOS_ESIGN);
+    }
+}
+
+
+/*
+** Length of the frame at B, or 0 if its lengths aren't complete yet.
+*/
+static size_t lzframelen(jmp_buf E, const char* B, size_t buflen, size_t* rawlen, size_t* complen)
+{
+    uint64_t v[2] = {0, 0};
+    size_t pos = 0;
+    for (int k = 0; k < 2; ++k) {
+        int shift = 0;
+        uint8_t c;
+        do {
+            if (pos == buflen) {
+                return 0;
+            }
+            if (shift == 7 * VARINT_MAXLEN) {
+                los_throw(E, LOS_ESIGN);
+            }
+            c = (uint8_t)B[pos++];
+            v[k] |= (uint64_t)(c & 0x7f) << shift;
+            shift += 7;
+        } while (c >= 0x80);
+        if (v[0] == 0) {
+            break;
+        }
+    }
+    if (v[0] > LZ_BLOCK || (v[0] > 0 && v[1] >= v[0])) {
+        los_throw(E, LOS_ESIGN);
+    }
+    *rawlen = (size_t)v[0];
+    *complen = (size_t)v[1];
+    return pos + (size_t)(v[1] ? v[1] : v[0]);
+}
+
+
+static void losbuf_flushlz(losbuf* B, const char* s, size_t len)
+{
+    losbuf* Z = B->next;
+    while (len > 0) {
+        size_t n = len < LZ_BLOCK ? len : LZ_BLOCK;
+        size_t complen = lzcompress(s, n, B->work);
+        size_t size = n;
+        if (complen >= n) {
+            complen = 0;
+        }
+        else {
+            size = complen;
+        }
+        B->nout += varintlen(n) + varintlen(complen) + size;
+        losbuf_addvarint(Z, n);
+        losbuf_addvarint(Z, complen);
+        losbuf_addlstring(Z, complen ? B->work : s, size);
+        s += n;
+        len -= n;
+    }
+}
+
+
+static void losbuf_flushnull(losbuf* B, const char* s, size_t len)
+{
+    (void)B;
+    (void)s;
+    (void)len;
+}
+
+
+/*
+** Sets B up to compress into Z. It takes two stack slots.
+*/
+static void losbuf_initlz(lua_State* L, losbuf* B, losbuf* Z)
+{
+    losbuf_init(L, B);
+    losbuf_resize(B, LZ_BLOCK);
+    B->work = lua_newuserdatauv(L, LZ_BOUND(LZ_BLOCK), 0);
+    B->flush = losbuf_flushlz;
+    B->next = Z;
+    B->E = Z->E;
+    B->nout = 0;
+}
+
+
+/*
+** Flushes the last block and ends the object, returning the length of
+** the frames.
+*/
+static size_t losbuf_finishlz(losbuf* B)
+{
+    losbuf_flushall(B);
+    losbuf_addchar(B->next, 0);
+    return B->nout + 1;
+}
+
+
+/*
+** Encodes the value at idx compressed into Z, returning the length of the
+** frames.
+*/
+static size_t dumplz(jmp_buf E, lua_State* L, losbuf* Z, losctx* C, int idx, int swap)
+{
+    losbuf B;
+    losbuf_initlz(L, &B, Z);
+    lua_pushvalue(L, idx);
+    dumpnext(swap)(E, L, &B, C);
+    size_t len = losbuf_finishlz(&B);
+    lua_pop(L, 3);
+    return len;
+}
+
+
+static size_t lzload(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C, int swap);
+
+
+static int los_size(lua_State* L)
+{
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 1);
+    int flags = dumpopts(L, 2);
+    lua_settop(L, 1);
+    losctx C;
+    ctxinit(L, &C, flags);
+    losbuf B;
+    size_t size;
+    if (flags & FLAG_LZ) {
+        losbuf_init(L, &B);
+        B.flush = losbuf_flushnull;
+        B.E = &E;
+        size = hdrlen(&C) + dumplz(E, L, &B, &C, 1, 0);
+    }
+    else {
+        losbuf_initcount(L, &B);
+        lua_pushvalue(L, 1);
+        size = dumphdr(&C, &B, SINK_COUNT);
+        size += dumplen(E, L, &B, &C);
+    }
+    lua_pushinteger(L, size);
+    return 1;
+}
+
+
+/*
+** A 64 bit hash of an object, walked the way encode walks it but without
+** writing anything. Scalars are tagged with their sign so 1 and 1.0 hash
+** apart just as they dump apart. Strings are mixed 8 bytes at a time,
+** read as little endian so a hash is the same on every machine. Each
+** item of a table is hashed as a key and value pair and the pairs are
+** summed, so neither the lua_next order nor the split between the array
+** and the hash part changes the result.
+*/
+#define HASH_MAXDEPTH 1000
+#define HASH_PATH 2
+#define HASH_K1 0x9e3779b97f4a7c15ULL
+#define HASH_K2 0xc2b2ae3d27d4eb4fULL
+#define HASH_K3 0x165667b19e3779f9ULL
+
+#define hashrotl(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+static uint64_t hashmix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+los_inline uint64_t hashword(const char* p, size_t n)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+        v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+
+los_inline uint64_t hashstep(uint64_t h, uint64_t k)
+{
+    k *= HASH_K2;
+    k = hashrotl(k, 31);
+    k *= HASH_K1;
+    h ^= k;
+    h = hashrotl(h, 27);
+    return h * 5 + 0x52dce729;
+}
+
+
+static uint64_t hashstring(uint64_t h, const char* s, size_t len)
+{
+    h ^= len * HASH_K3;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        h = hashstep(h, hashword(s + i, 8));
+    }
+    if (i < len) {
+        h = hashstep(h, hashword(s + i, len - i));
+    }
+    return hashmix(h);
+}
+
+
+#define hashtag(seed, sign) ((seed) + (uint64_t)(sign) * HASH_K2)
+
+
+/*
+** Hashes the value on top of the stack, leaving it there. The tables on
+** the path from the root are kept in the table at HASH_PATH so a cycle is
+** an error rather than a walk that never ends.
+*/
+static uint64_t hashvalue(jmp_buf E, lua_State* L, uint64_t seed, int depth)
+{
+    switch (lua_type(L, -1))
+    {
+    case LUA_TNIL: {
+        return hashmix(hashtag(seed, SIGN_NIL));
+    }
+    case LUA_TBOOLEAN: {
+        return hashmix(hashtag(seed, lua_toboolean(L, -1) ? SIGN_TRUE : SIGN_FALSE));
+    }
+    case LUA_TNUMBER: {
+        if (lua_isinteger(L, -1)) {
+            uint64_t v = (uint64_t)lua_tointeger(L, -1);
+            return hashmix(v ^ hashtag(seed, SIGN_INT8));
+        }
+        double d = lua_tonumber(L, -1);
+        uint64_t u;
+        memcpy(&u, &d, 8);
+        return hashmix(u ^ hashtag(seed, SIGN_FLT));
+    }
+    case LUA_TSTRING: {
+        size_t len;
+        const char* s = lua_tolstring(L, -1, &len);
+        return hashstring(hashtag(seed, SIGN_STR1), s, len);
+    }
+    case LUA_TTABLE: {
+        if (depth >= HASH_MAXDEPTH) {
+            los_throw(E, LOS_ETYPE);
+        }
+        luaL_checkstack(L, 3, NULL);
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, HASH_PATH) != LUA_TNIL) {
+            los_throw(E, LOS_ETYPE);
+        }
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, HASH_PATH);
+        uint64_t sum = 0;
+        uint64_t n = 0;
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            uint64_t v = hashvalue(E, L, seed, depth + 1);
+            lua_pop(L, 1);
+            uint64_t k = hashvalue(E, L, seed, depth + 1);
+            sum += hashmix(k * HASH_K3 + v);
+            ++n;
+        }
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, HASH_PATH);
+        return hashmix((sum + n * HASH_K1) ^ hashtag(seed, SIGN_TBLBEG));
+    }
+    default: {
+        los_throw(E, LOS_ETYPE);
+    }
+    }
+    return 0;
+}
+
+
+static int los_hash(lua_State* L)
+{
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, err);
+        return 2;
+    }
+    luaL_checkany(L, 1);
+    uint64_t seed = (uint64_t)luaL_optinteger(L, 2, 0);
+    lua_settop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, (lua_Integer)hashvalue(E, L, seed, 0));
+    return 1;
+}
+
+
+static int dumpvalue(lua_State* L, int swap)
+{
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 1);
+    losctx C;
+    if (lua_islightuserdata(L, 1)) {
+        char* b = lua_touserdata(L, 1);
+        size_t offset = luaL_checkinteger(L, 2);
+        size_t size = luaL_checkinteger(L, 3);
+        luaL_checkany(L, 4);
+        int flags = dumpopts(L, 5);
+        lua_settop(L, 4);
+        ctxinit(L, &C, flags);
+        losbuf B;
+        losbuf_initfixed(L, &B, b + offset, size, &E);
+        lua_pushvalue(L, 4);
+        size_t len = dumphdr(&C, &B, SINK_FIXED);
+        if (flags & FLAG_LZ) {
+            len += dumplz(E, L, &B, &C, 4, swap);
+        }
+        else {
+            len += swap ? dumpbuf_x(E, L, &B, &C) : dumpbuf(E, L, &B, &C);
+        }
+        lua_pushinteger(L, len);
+        return 1;
+    }
+    else {
+        int flags = dumpopts(L, 2);
+        lua_settop(L, 1);
+        ctxinit(L, &C, flags);
+        losbuf B;
+        if (flags & FLAG_LZ) {
+            losbuf_init(L, &B);
+            size_t len = dumphdr(&C, &B, SINK_BUF);
+            len += dumplz(E, L, &B, &C, 1, swap);
+            lua_pushinteger(L, len);
+            losbuf_pushresult(&B);
+            return 2;
+        }
+        losbuf_initcount(L, &B);
+        lua_pushvalue(L, 1);
+        size_t size = dumphdr(&C, &B, SINK_COUNT);
+        size += dumplen(E, L, &B, &C);
+        lua_settop(L, 1);
+        ctxinit(L, &C, flags);
+        losbuf_init(L, &B);
+        lua_pushvalue(L, 1);
+        losbuf_prep(&B, size);
+        size_t len = dumphdr(&C, &B, SINK_BUF);
+        len += dumpnext(swap)(E, L, &B, &C);
+        lua_pushinteger(L, len);
+        losbuf_pushresult(&B);
+        return 2;
+    }
+}
+
+
+static int los_dump(lua_State* L)
+{
+    return dumpvalue(L, 0);
+}
+
+
+static int los_dump_x(lua_State* L)
+{
+    return dumpvalue(L, 1);
+}
+
+
+/*
+** Batches. dumpmany writes the items of an array back to back, each one
+** as dump writes it alone, with a context of its own, so the result is a
+** stream that iter, load and the decoder read an object at a time. The
+** whole batch takes one call and, but for compressed objects, is sized
+** first and written into a single allocation.
+*/
+static size_t dumpitems(jmp_buf E, lua_State* L, losbuf* B, int t, int flags, int swap, int sink)
+{
+    size_t n = lua_rawlen(L, t);
+    size_t len = 0;
+    int top = lua_gettop(L);
+    for (size_t i = 1; i <= n; ++i) {
+        losctx C;
+        ctxinit(L, &C, flags);
+        lua_rawgeti(L, t, i);
+        len += dumphdr(&C, B, sink);
+        if (flags & FLAG_LZ) {
+            len += dumplz(E, L, B, &C, lua_gettop(L), swap);
+        }
+        else if (sink == SINK_COUNT) {
+            len += dumplen(E, L, B, &C);
+        }
+        else if (sink == SINK_FIXED) {
+            len += swap ? dumpbuf_x(E, L, B, &C) : dumpbuf(E, L, B, &C);
+        }
+        else {
+            len += dumpnext(swap)(E, L, B, &C);
+        }
+        lua_settop(L, top);
+    }
+    return len;
+}
+
+
+static int dumpbatch(lua_State* L, int swap)
+{
+    jmp_buf E;
+    los_try(E);
+    losbuf B;
+    if (lua_islightuserdata(L, 1)) {
+        char* b = lua_touserdata(L, 1);
+        size_t offset = luaL_checkinteger(L, 2);
+        size_t size = luaL_checkinteger(L, 3);
+        luaL_checktype(L, 4, LUA_TTABLE);
+        int flags = dumpopts(L, 5);
+        lua_settop(L, 4);
+        losbuf_initfixed(L, &B, b + offset, size, &E);
+        lua_pushinteger(L, dumpitems(E, L, &B, 4, flags, swap, SINK_FIXED));
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int flags = dumpopts(L, 2);
+    lua_settop(L, 1);
+    losbuf_init(L, &B);
+    if (!(flags & FLAG_LZ)) {
+        losbuf N;
+        losbuf_initcount(L, &N);
+        losbuf_prep(&B, dumpitems(E, L, &N, 1, flags, swap, SINK_COUNT));
+    }
+    lua_pushinteger(L, dumpitems(E, L, &B, 1, flags, swap, SINK_BUF));
+    losbuf_pushresult(&B);
+    return 2;
+}
+
+
+static int los_dumpmany(lua_State* L)
+{
+    return dumpbatch(L, 0);
+}
+
+
+static int los_dumpmany_x(lua_State* L)
+{
+    return dumpbatch(L, 1);
+}
+
+
+static int dumpsink(lua_State* L, int swap)
+{
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 2);
+    lua_Integer chunk = luaL_optinteger(L, 3, LOSBUF_CHUNKSIZE);
+    luaL_argcheck(L, chunk > 0, 3, "chunk size must be positive");
+    int flags = dumpopts(L, 4);
+    lua_settop(L, 2);
+    losctx C;
+    ctxinit(L, &C, flags);
+    losbuf B;
+    losbuf_initsink(L, &B, 1, (size_t)chunk, &E);
+    lua_pushvalue(L, 2);
+    size_t len = dumphdr(&C, &B, SINK_BUF);
+    if (flags & FLAG_LZ) {
+        len += dumplz(E, L, &B, &C, 2, swap);
+    }
+    else {
+        len += dumpnext(swap)(E, L, &B, &C);
+    }
+    losbuf_flushall(&B);
+    lua_pushinteger(L, len);
+    return 1;
+}
+
+
+static int los_dumpto(lua_State* L)
+{
+    return dumpsink(L, 0);
+}
+
+
+static int los_dumpto_x(lua_State* L)
+{
+    return dumpsink(L, 1);
+}
+
+
+/*
+** Encoders. An encoder owns an output buffer that dump appends objects to
+** and reset empties, keeping its capacity, so that encoding objects of
+** about the same size again and again allocates nothing once the buffer
+** has grown to fit them. The buffer is a box held in the encoder's user
+** value and replaced when it grows; a failed dump leaves the encoder as
+** it was.
+*/
+#define LOSENC_META "los.encoder"
+
+typedef struct losenc
+{
+    char*  b;
+    size_t size;
+    size_t n;
+    int    swap;
+} losenc;
+
+
+static int los_encoder_dump(lua_State* L)
+{
+    losenc* N = luaL_checkudata(L, 1, LOSENC_META);
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 2);
+    int flags = dumpopts(L, 3);
+    lua_settop(L, 2);
+    losctx C;
+    ctxinit(L, &C, flags);
+    losbuf B;
+    losbuf_init(L, &B);
+    lua_getiuservalue(L, 1, 1);
+    lua_replace(L, B.box);
+    B.b = N->b;
+    B.size = N->size;
+    B.n = N->n;
+    B.E = &E;
+    lua_pushvalue(L, 2);
+    size_t len = dumphdr(&C, &B, SINK_BUF);
+    if (flags & FLAG_LZ) {
+        len += dumplz(E, L, &B, &C, 2, N->swap);
+    }
+    else {
+        len += dumpnext(N->swap)(E, L, &B, &C);
+    }
+    if (B.b != N->b) {
+        lua_pushvalue(L, B.box);
+        lua_setiuservalue(L, 1, 1);
+        N->b = B.b;
+        N->size = B.size;
+    }
+    N->n = B.n;
+    lua_pushinteger(L, len);
+    return 1;
+}
+
+
+static int los_encoder_reset(lua_State* L)
+{
+    losenc* N = luaL_checkudata(L, 1, LOSENC_META);
+    N->n = 0;
+    return 0;
+}
+
+
+static int los_encoder_size(lua_State* L)
+{
+    losenc* N = luaL_checkudata(L, 1, LOSENC_META);
+    lua_pushinteger(L, (lua_Integer)N->n);
+    return 1;
+}
+
+
+static int los_encoder_ptr(lua_State* L)
+{
+    losenc* N = luaL_checkudata(L, 1, LOSENC_META);
+    lua_pushlightuserdata(L, N->b);
+    return 1;
+}
+
+
+static int los_encoder_tostring(lua_State* L)
+{
+    losenc* N = luaL_checkudata(L, 1, LOSENC_META);
+    lua_pushlstring(L, N->b, N->n);
+    return 1;
+}
+
+
+static int newencoder(lua_State* L, int swap)
+{
+    lua_Integer size = luaL_optinteger(L, 1, LOSBUF_INITSIZE);
+    luaL_argcheck(L, size >= 0, 1, "capacity must not be negative");
+    losenc* N = lua_newuserdatauv(L, sizeof(losenc), 1);
+    N->b = lua_newuserdatauv(L, (size_t)size, 0);
+    lua_setiuservalue(L, -2, 1);
+    N->size = (size_t)size;
+    N->n = 0;
+    N->swap = swap;
+    luaL_setmetatable(L, LOSENC_META);
+    return 1;
+}
+
+
+static int los_encoder(lua_State* L)
+{
+    return newencoder(L, 0);
+}
+
+
+static int los_encoder_x(lua_State* L)
+{
+    return newencoder(L, 1);
+}
+
+
+/*
+** Loads the object at B onto the stack, returning its length.
+*/
+static size_t loadobject(jmp_buf E, lua_State* L, const char* B, size_t size, int swap)
+{
+    losctx C;
+    size_t consume = loadhdr(E, L, &C, B, size);
+    if (C.flags & FLAG_LZ) {
+        return consume + lzload(E, L, B + consume, size - consume, &C, swap);
+    }
+    size_t n = loadnext(swap)(E, L, B + consume, size - consume, &C);
+    if (n == 0) {
+        los_throw(E, LOS_ESIGN);
+    }
+    return consume + n;
+}
+
+
+#define LOAD_MAXTHREADS 64
+
+/*
+** Number of threads asked for by the options of load at idx.
+*/
+static int loadopts(lua_State* L, int idx)
+{
+    if (lua_isnoneornil(L, idx)) {
+        return 1;
+    }
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "threads");
+    int isint;
+    lua_Integer n = lua_tointegerx(L, -1, &isint);
+    if (!isint && !lua_isnil(L, -1)) {
+        luaL_argerror(L, idx, "threads must be an integer");
+    }
+    lua_pop(L, 1);
+    return n < 1 ? 1 : n > LOAD_MAXTHREADS ? LOAD_MAXTHREADS : (int)n;
+}
+
+
+static size_t loadsplit(jmp_buf E, lua_State* L, const char* B, size_t size, int swap, int threads);
+
+
+static int loadvalue(lua_State* L, int swap)
+{
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 1);
+    const char* B;
+    size_t size;
+    int threads;
+    if (lua_islightuserdata(L, 1)) {
+        B = lua_touserdata(L, 1);
+        size = luaL_checkinteger(L, 2);
+        threads = loadopts(L, 3);
+        lua_settop(L, 2);
+    }
+    else {
+        luaL_argexpected(L, lua_isstring(L, 1), 1, lua_typename(L, LUA_TSTRING));
+        threads = loadopts(L, 2);
+        lua_settop(L, 1);
+        B = lua_tolstring(L, 1, &size);
+    }
+    lua_pushinteger(L, threads > 1 ? loadsplit(E, L, B, size, swap, threads)
+                                   : loadobject(E, L, B, size, swap));
+    lua_rotate(L, -2, 1);
+    return 2;
+}
+
+
+static int los_load(lua_State* L)
+{
+    return loadvalue(L, 0);
+}
+
+
+static int los_load_x(lua_State* L)
+{
+    return loadvalue(L, 1);
+}
+
+
+/*
+** Iterator over a stream of objects, such as the output of dumpmany. The
+** control variable is the offset of the next object; a failure takes its
+** place as the error code and ends the iteration.
+*/
+static int iternext(lua_State* L, int swap)
+{
+    jmp_buf E;
+    los_try(E);
+    lua_Integer off = luaL_checkinteger(L, 2);
+    const char* B;
+    size_t size;
+    if (lua_islightuserdata(L, lua_upvalueindex(1))) {
+        B = lua_touserdata(L, lua_upvalueindex(1));
+        size = (size_t)lua_tointeger(L, lua_upvalueindex(2));
+    }
+    else {
+        B = lua_tolstring(L, lua_upvalueindex(1), &size);
+    }
+    if (off < 0 || (lua_Unsigned)off >= size) {
+        return 0;
+    }
+    size_t n = loadobject(E, L, B + off, size - (size_t)off, swap);
+    lua_pushinteger(L, off + n);
+    lua_rotate(L, -2, 1);
+    return 2;
+}
+
+
+static int los_iternext(lua_State* L)
+{
+    return iternext(L, 0);
+}
+
+
+static int los_iternext_x(lua_State* L)
+{
+    return iternext(L, 1);
+}
+
+
+static int itervalue(lua_State* L, int swap)
+{
+    luaL_checkany(L, 1);
+    if (lua_islightuserdata(L, 1)) {
+        luaL_checkinteger(L, 2);
+        lua_settop(L, 2);
+    }
+    else {
+        luaL_argexpected(L, lua_isstring(L, 1), 1, lua_typename(L, LUA_TSTRING));
+        lua_settop(L, 1);
+        lua_pushnil(L);
+    }
+    lua_pushcclosure(L, swap ? los_iternext_x : los_iternext, 2);
+    lua_pushnil(L);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+
+static int los_iter(lua_State* L)
+{
+    return itervalue(L, 0);
+}
+
+
+static int los_iter_x(lua_State* L)
+{
+    return itervalue(L, 1);
+}
+
+
+/*
+** Files. loadfile maps the file read-only and loads straight from the
+** mapping, so its content is never copied into a Lua string; where mmap
+** isn't available it is read into a buffer instead. dumpfile streams the
+** encoding in chunks into a temporary file next to the target and renames
+** it over the target once complete, so a failed dump leaves the target as
+** it was. The file is held by a userdata whose finalizer releases it, and
+** removes the temporary file if it is still there, so an error raised
+** halfway doesn't leak either.
+*/
+#define LOSFILE_META "los.file"
+
+typedef struct losfile
+{
+    FILE*  f;
+    char*  map;
+    size_t len;
+    const char* tmp;
+} losfile;
+
+
+static int losfile_close(losfile* F)
+{
+    int ok = 1;
+    if (F->map) {
+#ifdef _WIN32
+        free(F->map);
+#else
+        munmap(F->map, F->len);
+#endif
+        F->map = NULL;
+    }
+    if (F->f) {
+        ok = fclose(F->f) == 0;
+        F->f = NULL;
+    }
+    return ok;
+}
+
+
+/*
+** Closes F and removes its temporary file.
+*/
+static void losfile_discard(losfile* F)
+{
+    losfile_close(F);
+    if (F->tmp) {
+        remove(F->tmp);
+        F->tmp = NULL;
+    }
+}
+
+
+static int los_file_gc(lua_State* L)
+{
+    losfile_discard(luaL_checkudata(L, 1, LOSFILE_META));
+    return 0;
+}
+
+
+static losfile* newfile(lua_State* L)
+{
+    losfile* F = lua_newuserdatauv(L, sizeof(losfile), 1);
+    F->f = NULL;
+    F->map = NULL;
+    F->len = 0;
+    F->tmp = NULL;
+    luaL_setmetatable(L, LOSFILE_META);
+    return F;
+}
+
+
+/*
+** Maps the file at path into F, returning 0 if it can't be read.
+*/
+static int mapfile(losfile* F, const char* path)
+{
+#ifdef _WIN32
+    F->f = fopen(path, "rb");
+    if (F->f == NULL || fseek(F->f, 0, SEEK_END) != 0) {
+        return 0;
+    }
+    long len = ftell(F->f);
+    if (len < 0 || fseek(F->f, 0, SEEK_SET) != 0) {
+        return 0;
+    }
+    F->len = (size_t)len;
+    if (F->len > 0) {
+        F->map = malloc(F->len);
+        if (F->map == NULL || fread(F->map, 1, F->len, F->f) != F->len) {
+            return 0;
+        }
+    }
+    return 1;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    F->len = (size_t)st.st_size;
+    if (F->len > 0) {
+        void* p = mmap(NULL, F->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        posix_madvise(p, F->len, POSIX_MADV_SEQUENTIAL);
+        F->map = p;
+    }
+    close(fd);
+    return 1;
+#endif
+}
+
+
+static int loadpath(lua_State* L, int swap)
+{
+    const char* path = luaL_checkstring(L, 1);
+    int threads = loadopts(L, 2);
+    lua_settop(L, 1);
+    losfile* F = newfile(L);
+    if (!mapfile(F, path)) {
+        losfile_close(F);
+        lua_pushinteger(L, LOS_EIO);
+        return 1;
+    }
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        losfile_close(F);
+        lua_pushinteger(L, err);
+        return 1;
+    }
+    size_t n = threads > 1 ? loadsplit(E, L, F->map, F->len, swap, threads)
+                           : loadobject(E, L, F->map, F->len, swap);
+    losfile_close(F);
+    lua_pushinteger(L, n);
+    lua_rotate(L, -2, 1);
+    return 2;
+}
+
+
+static int los_loadfile(lua_State* L)
+{
+    return loadpath(L, 0);
+}
+
+
+static int los_loadfile_x(lua_State* L)
+{
+    return loadpath(L, 1);
+}
+
+
+/*
+** Opens a new temporary file next to path for writing into F, keeping its
+** name as the user value of F on the top of the stack. Returns the name,
+** or NULL if it can't be created. Elsewhere than on Windows the name is
+** unique, so concurrent dumps to one path never share a temporary file.
+*/
+static const char* opentemp(lua_State* L, losfile* F, const char* path)
+{
+#ifdef _WIN32
+    const char* tmp = lua_pushfstring(L, "%s.tmp", path);
+    lua_setiuservalue(L, -2, 1);
+    F->f = fopen(tmp, "wb");
+    if (F->f == NULL) {
+        return NULL;
+    }
+#else
+    size_t size = strlen(path) + 8;
+    char* name = lua_newuserdatauv(L, size, 0);
+    snprintf(name, size, "%s.XXXXXX", path);
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    const char* tmp = lua_pushstring(L, name);
+    lua_setiuservalue(L, -3, 1);
+    lua_pop(L, 1);
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    F->f = fdopen(fd, "wb");
+    if (F->f == NULL) {
+        close(fd);
+        remove(tmp);
+        return NULL;
+    }
+#endif
+    F->tmp = tmp;
+    return tmp;
+}
+
+
+static int dumppath(lua_State* L, int swap)
+{
+    const char* path = luaL_checkstring(L, 1);
+    luaL_checkany(L, 2);
+    int flags = dumpopts(L, 3);
+    lua_settop(L, 2);
+    losfile* F = newfile(L);
+    const char* tmp = opentemp(L, F, path);
+    if (tmp == NULL) {
+        lua_pushinteger(L, LOS_EIO);
+        return 1;
+    }
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        losfile_discard(F);
+        lua_pushinteger(L, err);
+        return 1;
+    }
+    losctx C;
+    ctxinit(L, &C, flags);
+    losbuf B;
+    losbuf_init(L, &B);
+    B.flush = losbuf_flushfile;
+    B.file = F->f;
+    B.E = &E;
+    losbuf_resize(&B, LOSBUF_CHUNKSIZE);
+    lua_pushvalue(L, 2);
+    size_t len = dumphdr(&C, &B, SINK_BUF);
+    if (flags & FLAG_LZ) {
+        len += dumplz(E, L, &B, &C, 2, swap);
+    }
+    else {
+        len += dumpnext(swap)(E, L, &B, &C);
+    }
+    losbuf_flushall(&B);
+    if (!losfile_close(F)) {
+        los_throw(E, LOS_EIO);
+    }
+    if (rename(tmp, path) != 0) {
+#ifdef _WIN32
+        if (remove(path) != 0 || rename(tmp, path) != 0) {
+            los_throw(E, LOS_EIO);
+        }
+#else
+        los_throw(E, LOS_EIO);
+#endif
+    }
+    F->tmp = NULL;
+    lua_pushinteger(L, len);
+    return 1;
+}
+
+
+static int los_dumpfile(lua_State* L)
+{
+    return dumppath(L, 0);
+}
+
+
+static int los_dumpfile_x(lua_State* L)
+{
+    return dumppath(L, 1);
+}
+
+
+/*
+** Copy between states. los_copy rebuilds the value at idx of from on the
+** top of to, for hosts passing values between the states of different
+** threads. It walks the value the way dump does, without encoding it:
+** tables are created presized and filled straight from the source, and
+** a table met twice is copied once, so shared tables stay shared and
+** cycles are copied as cycles. Everything allocated is allocated in to,
+** under a protected call, so from is only read. It returns 0, ETYPE for
+** a value of a type dump doesn't take, or the status of an error raised
+** in to; both stacks are as they were then.
+*/
+typedef struct loscopy
+{
+    lua_State* from;
+    int idx;
+    int seen;
+    int err;
+    jmp_buf* E;
+} loscopy;
+
+
+static void copyvalue(loscopy* K, lua_State* T)
+{
+    lua_State* F = K->from;
+    switch (lua_type(F, -1))
+    {
+    case LUA_TNIL: {
+        lua_pushnil(T);
+        break;
+    }
+    case LUA_TBOOLEAN: {
+        lua_pushboolean(T, lua_toboolean(F, -1));
+        break;
+    }
+    case LUA_TNUMBER: {
+        if (lua_isinteger(F, -1)) {
+            lua_pushinteger(T, lua_tointeger(F, -1));
+        }
+        else {
+            lua_pushnumber(T, lua_tonumber(F, -1));
+        }
+        break;
+    }
+    case LUA_TSTRING: {
+        size_t len;
+        const char* s = lua_tolstring(F, -1, &len);
+        lua_pushlstring(T, s, len);
+        break;
+    }
+    case LUA_TTABLE: {
+        void* p = (void*)lua_topointer(F, -1);
+        lua_pushlightuserdata(T, p);
+        if (lua_rawget(T, K->seen) == LUA_TTABLE) {
+            break;
+        }
+        lua_pop(T, 1);
+        if (!lua_checkstack(F, 3)) {
+            luaL_error(T, "stack overflow");
+        }
+        luaL_checkstack(T, 4, NULL);
+        size_t narr = lua_rawlen(F, -1);
+        size_t nrec = hashlen(F, narr);
+        lua_createtable(T, narr > INT_MAX ? INT_MAX : (int)narr, nrec > INT_MAX ? INT_MAX : (int)nrec);
+        lua_pushlightuserdata(T, p);
+        lua_pushvalue(T, -2);
+        lua_rawset(T, K->seen);
+        for (size_t i = 1; i <= narr; ++i) {
+            lua_rawgeti(F, -1, i);
+            copyvalue(K, T);
+            lua_pop(F, 1);
+            lua_rawseti(T, -2, i);
+        }
+        lua_pushnil(F);
+        while (lua_next(F, -2)) {
+            if (isarraykey(F, narr)) {
+                lua_pop(F, 1);
+                continue;
+            }
+            lua_pushvalue(F, -2);
+            copyvalue(K, T);
+            lua_pop(F, 1);
+            copyvalue(K, T);
+            lua_pop(F, 1);
+            lua_rawset(T, -3);
+        }
+        break;
+    }
+    default: {
+        los_throw(*K->E, LOS_ETYPE);
+    }
+    }
+}
+
+
+static int copymain(lua_State* T)
+{
+    loscopy* K = lua_touserdata(T, 1);
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        K->err = err;
+        return lua_error(T);
+    }
+    K->E = &E;
+    lua_newtable(T);
+    K->seen = lua_gettop(T);
+    lua_pushvalue(K->from, K->idx);
+    copyvalue(K, T);
+    return 1;
+}
+
+
+LUA_MOD_EXPORT int los_copy(lua_State* from, int idx, lua_State* to)
+{
+    int top = lua_gettop(from);
+    loscopy K;
+    K.from = from;
+    K.idx = lua_absindex(from, idx);
+    K.err = 0;
+    if (!lua_checkstack(from, 1) || !lua_checkstack(to, 2)) {
+        return LUA_ERRMEM;
+    }
+    lua_pushcfunction(to, copymain);
+    lua_pushlightuserdata(to, &K);
+    int status = lua_pcall(to, 1, 1, 0);
+    lua_settop(from, top);
+    if (status != LUA_OK) {
+        lua_pop(to, 1);
+        return K.err ? K.err : status;
+    }
+    return 0;
+}
+
+
+/*
+** Incremental decoder. It takes the binary format in pieces of any size
+** and keeps its parse state between calls: the tables under construction
+** live on the stack of a thread of its own, together with a frame per
+** table recording how far it got, and a scalar split between two pieces
+** is collected in a side buffer until it is complete. Scalars are decoded
+** with load or load_x, which also handle the decoder's endian.
+**
+** Index blocks and packed arrays are streamed like tables: an index block
+** gets the frame of its table, which skips the footer once the table is
+** done, and a packed array a frame taking its elements as they come.
+** Columnar blocks are taken whole, as scalars. The side buffer grows with
+** the bytes received rather than to the length an item announces, so a
+** large announced length costs nothing before its bytes arrive.
+**
+** All of the decoding runs in a protected call on that thread, with its
+** stack passed as the arguments, so the slots keep their indices and a
+** Lua error, such as running out of memory, fails the decoder instead of
+** escaping through a thread nobody is running.
+**
+** A compressed object switches the decoder to frames: each one is
+** collected in a second side buffer, inflated into a block buffer and
+** fed back to the decoder as plain bytes, until the end frame.
+*/
+#define LOSDEC_META "los.decoder"
+#define LOSDEC_MAXHINT 65536
+
+#define DEC_BEGIN 0
+#define DEC_NARR  1
+#define DEC_NREC  2
+#define DEC_ARRAY 3
+#define DEC_HVAL  4
+#define DEC_HKEY  5
+#define DEC_SKEY  6
+#define DEC_SVAL  7
+#define DEC_ELEM  8
+
+#define DECUV_THREAD 1
+#define DECUV_FRAMES 2
+#define DECUV_PART   3
+#define DECUV_FRAME  4
+#define DECUV_BLOCK  5
+
+#define DECLZ_OFF   0
+#define DECLZ_FRAME 1
+#define DECLZ_BLOCK 2
+
+typedef struct losdec_frame
+{
+    int phase;
+    int narr;
+    int nrec;
+    lua_Integer idx;
+    size_t end;
+} losdec_frame;
+
+typedef struct losdec_part
+{
+    char*  b;
+    size_t len;
+    size_t need;
+    size_t cap;
+} losdec_part;
+
+typedef struct losdec
+{
+    lua_State* T;
+    int    swap;
+    int    err;
+    int    busy;
+    int    depth;
+    int    maxdepth;
+    losdec_frame* frames;
+    losdec_part part;
+    losdec_part frame;
+    char*  block;
+    int    lz;
+    int    self;
+    int    done;
+    size_t off;
+    size_t skip;
+    const char* in;
+    size_t inlen;
+    size_t inpos;
+    losctx C;
+} losdec;
+
+
+static uint32_t getlen(const char* B, int n, int swap)
+{
+    return n == 1 ? (uint8_t)B[0] : n == 2 ? get16(B, swap) : get32(B, swap);
+}
+
+
+/*
+** Length of the scalar item starting at B, or 0 if its header isn't
+** complete yet.
+*/
+static size_t itemlen(jmp_buf E, const char* B, size_t buflen, int swap)
+{
+    if (buflen == 0) {
+        return 0;
+    }
+    uint8_t c = (uint8_t)B[0];
+    if (IS_SHRINT(c)) {
+        return 1;
+    }
+    if (IS_SHRSTR(c)) {
+        return 1 + (c & ~MASK_SHRSTR);
+    }
+    switch (c)
+    {
+    case SIGN_NIL:
+    case SIGN_FALSE:
+    case SIGN_TRUE: {
+        return 1;
+    }
+    case SIGN_INT1: {
+        return 2;
+    }
+    case SIGN_INT2: {
+        return 3;
+    }
+    case SIGN_INT4: {
+        return 5;
+    }
+    case SIGN_INT8:
+    case SIGN_FLT: {
+        return 9;
+    }
+    case SIGN_STR1: {
+        return buflen < 2 ? 0 : 2 + (size_t)getlen(B + 1, 1, swap);
+    }
+    case SIGN_STR2: {
+        return buflen < 3 ? 0 : 3 + (size_t)getlen(B + 1, 2, swap);
+    }
+    case SIGN_STR4: {
+        return buflen < 5 ? 0 : 5 + (size_t)getlen(B + 1, 4, swap);
+    }
+    case SIGN_HDR: {
+        return 2;
+    }
+    case SIGN_STRREF:
+    case SIGN_TBLREF:
+    case SIGN_SHAPE:
+    case SIGN_SHPDEF:
+    case SIGN_VINT: {
+        for (size_t i = 1; i < buflen && i <= VARINT_MAXLEN; ++i) {
+            if ((uint8_t)B[i] < 0x80) {
+                return i + 1;
+            }
+        }
+        if (buflen > VARINT_MAXLEN) {
+            los_throw(E, LOS_ESIGN);
+        }
+        return 0;
+    }
+    case SIGN_ARRAY: {
+        uint64_t n = 0;
+        int type = buflen > 1 ? (uint8_t)B[1] : ARR_F64;
+        if (type < ARR_F64 || type > ARR_BOOL) {
+            los_throw(E, LOS_ESIGN);
+        }
+        for (size_t i = 2; i < buflen && i <= VARINT_MAXLEN + 1; ++i) {
+            n |= (uint64_t)(B[i] & 0x7f) << (7 * (i - 2));
+            if ((uint8_t)B[i] < 0x80) {
+                if (n > (SIZE_MAX - (i + 1)) / 8) {
+                    los_throw(E, LOS_ESIGN);
+                }
+                return i + 1 + arraylen(n, type);
+            }
+        }
+        if (buflen > VARINT_MAXLEN + 1) {
+            los_throw(E, LOS_ESIGN);
+        }
+        return 0;
+    }
+    case SIGN_COLUMNS:
+    case SIGN_VSTR:
+    case SIGN_INDEX: {
+        uint64_t len = 0;
+        for (size_t i = 1; i < buflen && i <= VARINT_MAXLEN; ++i) {
+            len |= (uint64_t)(B[i] & 0x7f) << (7 * (i - 1));
+            if ((uint8_t)B[i] < 0x80) {
+                if (len > SIZE_MAX - (i + 1)) {
+                    los_throw(E, LOS_ESIGN);
+                }
+                return i + 1 + len;
+            }
+        }
+        if (buflen > VARINT_MAXLEN) {
+            los_throw(E, LOS_ESIGN);
+        }
+        return 0;
+    }
+    default: {
+        los_throw(E, LOS_ESIGN);
+    }
+    }
+    return 0;
+}
+
+
+/*
+** Length of the item starting at B as the decoder takes it, or 0 if it
+** isn't complete yet. Index blocks are taken up to their SIGN_TBLBEG and
+** packed arrays up to their first element, the rest is streamed.
+*/
+static size_t dechead(jmp_buf E, const char* B, size_t buflen, int swap)
+{
+    uint8_t c = buflen > 0 ? (uint8_t)B[0] : 0;
+    if (c != SIGN_INDEX && c != SIGN_ARRAY) {
+        return itemlen(E, B, buflen, swap);
+    }
+    size_t first = c == SIGN_INDEX ? 1 : 2;
+    if (c == SIGN_ARRAY && buflen > 1 && ((uint8_t)B[1] < ARR_F64 || (uint8_t)B[1] > ARR_BOOL)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    for (size_t i = first; i < buflen && i < first + VARINT_MAXLEN; ++i) {
+        if ((uint8_t)B[i] < 0x80) {
+            return c == SIGN_INDEX ? i + 2 : i + 1;
+        }
+    }
+    if (buflen >= first + VARINT_MAXLEN) {
+        los_throw(E, LOS_ESIGN);
+    }
+    return 0;
+}
+
+
+/*
+** Shaped tables get a frame too: DEC_SKEY collects the keys of a new
+** shape, then DEC_SVAL sets the values under the keys of shape narr.
+*/
+static void decshapebegin(losdec* D, losdec_frame* f)
+{
+    lua_State* T = D->T;
+    lua_rawgeti(T, D->C.shapes, f->narr);
+    f->nrec = (int)lua_rawlen(T, -1);
+    lua_pop(T, 1);
+    lua_createtable(T, 0, f->nrec);
+    tbldef(T, &D->C);
+    f->phase = DEC_SVAL;
+    f->idx = 1;
+}
+
+
+static void decvalue(jmp_buf E, losdec* D)
+{
+    lua_State* T = D->T;
+    if (D->depth == 0) {
+        ++D->done;
+        D->C.flags = 0;
+        return;
+    }
+    losdec_frame* f = &D->frames[D->depth - 1];
+    switch (f->phase)
+    {
+    case DEC_NARR: {
+        f->narr = tblsize(E, T, 1, LOSDEC_MAXHINT);
+        f->phase = DEC_NREC;
+        break;
+    }
+    case DEC_NREC: {
+        f->nrec = tblsize(E, T, 1, LOSDEC_MAXHINT);
+        lua_createtable(T, f->narr, f->nrec);
+        tbldef(T, &D->C);
+        f->phase = DEC_ARRAY;
+        break;
+    }
+    case DEC_ARRAY: {
+        lua_rawseti(T, -2, f->idx++);
+        break;
+    }
+    case DEC_HVAL: {
+        f->phase = DEC_HKEY;
+        break;
+    }
+    case DEC_HKEY: {
+        checkkey(E, T);
+        lua_rotate(T, -2, 1);
+        lua_rawset(T, -3);
+        f->phase = DEC_HVAL;
+        break;
+    }
+    case DEC_SKEY: {
+        if (lua_type(T, -1) != LUA_TSTRING) {
+            los_throw(E, LOS_ESIGN);
+        }
+        lua_rawseti(T, -2, f->idx++);
+        if (f->idx > f->nrec) {
+            lua_rawseti(T, D->C.shapes, ++D->C.nshape);
+            f->narr = (int)D->C.nshape;
+            decshapebegin(D, f);
+        }
+        break;
+    }
+    case DEC_SVAL: {
+        lua_rawgeti(T, D->C.shapes, f->narr);
+        lua_rawgeti(T, -1, f->idx++);
+        lua_replace(T, -2);
+        lua_rotate(T, -2, 1);
+        lua_rawset(T, -3);
+        if (f->idx > f->nrec) {
+            --D->depth;
+            decvalue(E, D);
+        }
+        break;
+    }
+    default: {
+        los_throw(E, LOS_ESIGN);
+    }
+    }
+}
+
+
+static void decpush(lua_State* L, losdec* D)
+{
+    if (D->depth == D->maxdepth) {
+        int maxdepth = D->maxdepth * 2;
+        losdec_frame* frames = lua_newuserdatauv(L, maxdepth * sizeof(losdec_frame), 0);
+        memcpy(frames, D->frames, D->depth * sizeof(losdec_frame));
+        lua_setiuservalue(L, D->self, DECUV_FRAMES);
+        D->frames = frames;
+        D->maxdepth = maxdepth;
+    }
+    losdec_frame* f = &D->frames[D->depth++];
+    f->phase = DEC_BEGIN;
+    f->narr = 0;
+    f->nrec = 0;
+    f->idx = 1;
+    f->end = 0;
+}
+
+
+/*
+** The header of a top-level object sets the flags for that object only.
+** The decoder keeps the strings, tables and shapes of the header flags in
+** slots 1 to 3 of its thread, the completed objects follow them.
+*/
+static void dechdr(jmp_buf E, lua_State* L, losdec* D, const char* B)
+{
+    lua_State* T = D->T;
+    int flags = (uint8_t)B[1];
+    if (D->depth != 0 || D->lz != DECLZ_OFF || (flags & ~FLAG_ALL)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    if (flags & FLAG_LZ) {
+        if (D->block == NULL) {
+            D->block = lua_newuserdatauv(L, LZ_BLOCK, 0);
+            lua_setiuservalue(L, D->self, DECUV_BLOCK);
+        }
+        flags &= ~FLAG_LZ;
+        D->lz = DECLZ_FRAME;
+    }
+    lua_newtable(T);
+    lua_replace(T, 1);
+    lua_newtable(T);
+    lua_replace(T, 2);
+    lua_newtable(T);
+    lua_replace(T, 3);
+    D->C.flags = flags;
+    D->C.nstr = 0;
+    D->C.ntbl = 0;
+    D->C.nshape = 0;
+}
+
+
+static void decshape(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    uint64_t v;
+    getvarint(E, B + 1, len - 1, &v);
+    if (!(D->C.flags & FLAG_SHAPE)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    if ((uint8_t)B[0] == SIGN_SHPDEF) {
+        if (v == 0 || v > INT_MAX) {
+            los_throw(E, LOS_ESIGN);
+        }
+        decpush(L, D);
+        losdec_frame* f = &D->frames[D->depth - 1];
+        f->phase = DEC_SKEY;
+        f->nrec = (int)v;
+        lua_createtable(D->T, v > LOSDEC_MAXHINT ? LOSDEC_MAXHINT : (int)v, 0);
+    }
+    else {
+        if (v >= (uint64_t)D->C.nshape) {
+            los_throw(E, LOS_ESIGN);
+        }
+        decpush(L, D);
+        losdec_frame* f = &D->frames[D->depth - 1];
+        f->narr = (int)v + 1;
+        decshapebegin(D, f);
+    }
+}
+
+
+/*
+** An index block opens a frame for its table, recording where the block
+** ends so its footer is skipped after SIGN_TBLEND. D->off is just past
+** the SIGN_TBLBEG of the table.
+*/
+static void decindex(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    uint64_t v;
+    size_t n = 1 + getvarint(E, B + 1, len - 1, &v);
+    if (!(D->C.flags & FLAG_INDEX) || v == 0 || v > SIZE_MAX - D->off ||
+        (uint8_t)B[n] != SIGN_TBLBEG) {
+        los_throw(E, LOS_ESIGN);
+    }
+    decpush(L, D);
+    D->frames[D->depth - 1].end = D->off - 1 + (size_t)v;
+}
+
+
+/*
+** A packed array opens a DEC_ELEM frame taking its elements as they
+** come, narr holding the element type and nrec the count. Returns 1 if
+** the array is empty and so already complete.
+*/
+static int decarray(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    int type = (uint8_t)B[1];
+    uint64_t narr;
+    getvarint(E, B + 2, len - 2, &narr);
+    if (narr > INT_MAX) {
+        los_throw(E, LOS_ESIGN);
+    }
+    lua_createtable(D->T, narr > LOSDEC_MAXHINT ? LOSDEC_MAXHINT : (int)narr, 0);
+    tbldef(D->T, &D->C);
+    if (narr == 0) {
+        return 1;
+    }
+    decpush(L, D);
+    losdec_frame* f = &D->frames[D->depth - 1];
+    f->phase = DEC_ELEM;
+    f->narr = type;
+    f->nrec = (int)narr;
+    return 0;
+}
+
+
+/*
+** Sets the whole elements in B into the packed array of the top frame,
+** returning the bytes taken: 0 if not even one element is there.
+*/
+static size_t decelems(jmp_buf E, losdec* D, const char* B, size_t len)
+{
+    losdec_frame* f = &D->frames[D->depth - 1];
+    int type = f->narr;
+    size_t left = (size_t)(f->nrec - f->idx + 1);
+    size_t n = type == ARR_BOOL ? (len > left / 8 ? left : len * 8)
+                                : len / arrwidth[type];
+    if (n > left) {
+        n = left;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i += ARRAY_CHUNK) {
+        size_t k = n - i < ARRAY_CHUNK ? n - i : ARRAY_CHUNK;
+        unpackchunk(D->T, B + arraylen(i, type), (size_t)f->idx, k, type, D->swap);
+        f->idx += k;
+    }
+    if (f->idx > f->nrec) {
+        --D->depth;
+        decvalue(E, D);
+    }
+    return arraylen(n, type);
+}
+
+
+static int decload(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    switch ((uint8_t)B[0])
+    {
+    case SIGN_HDR: {
+        dechdr(E, L, D, B);
+        return 0;
+    }
+    case SIGN_INDEX: {
+        decindex(E, L, D, B, len);
+        return 0;
+    }
+    case SIGN_ARRAY: {
+        return decarray(E, L, D, B, len);
+    }
+    case SIGN_SHAPE:
+    case SIGN_SHPDEF: {
+        decshape(E, L, D, B, len);
+        return 0;
+    }
+    }
+    if (D->swap) {
+        load_x(E, D->T, B, len, &D->C);
+    }
+    else {
+        load(E, D->T, B, len, &D->C);
+    }
+    return 1;
+}
+
+
+static void decpartadd(lua_State* L, losdec* D, losdec_part* P, int uv,
+                       const char* B, size_t len)
+{
+    size_t need = P->len + len;
+    if (need > P->cap) {
+        size_t cap = P->cap < P->need / 2 ? P->cap * 2 : P->need;
+        if (cap < need) {
+            cap = need;
+        }
+        if (cap < 16) {
+            cap = 16;
+        }
+        char* b = lua_newuserdatauv(L, cap, 0);
+        if (P->len > 0) {
+            memcpy(b, P->b, P->len);
+        }
+        lua_setiuservalue(L, D->self, uv);
+        P->b = b;
+        P->cap = cap;
+    }
+    memcpy(P->b + P->len, B, len);
+    P->len += len;
+}
+
+
+static size_t decpart(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    losdec_part* P = &D->part;
+    size_t pos = 0;
+    while (P->need == 0) {
+        if (pos == len) {
+            D->off += pos;
+            return pos;
+        }
+        decpartadd(L, D, P, DECUV_PART, B + pos, 1);
+        ++pos;
+        P->need = dechead(E, P->b, P->len, D->swap);
+    }
+    size_t take = P->need - P->len;
+    if (take > len - pos) {
+        take = len - pos;
+    }
+    decpartadd(L, D, P, DECUV_PART, B + pos, take);
+    pos += take;
+    D->off += pos;
+    if (P->len == P->need) {
+        size_t n = P->len;
+        P->len = 0;
+        P->need = 0;
+        if (D->depth > 0 && D->frames[D->depth - 1].phase == DEC_ELEM) {
+            decelems(E, D, P->b, n);
+        }
+        else if (decload(E, L, D, P->b, n)) {
+            decvalue(E, D);
+        }
+    }
+    return pos;
+}
+
+
+static void decfeed(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len);
+
+
+static void decblock(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    size_t rawlen;
+    size_t complen;
+    size_t n = lzframelen(E, B, len, &rawlen, &complen);
+    if (rawlen == 0) {
+        if (D->depth != 0 || D->part.len != 0 || D->skip != 0) {
+            los_throw(E, LOS_ESIGN);
+        }
+        D->lz = DECLZ_OFF;
+        return;
+    }
+    const char* data = B + n - (complen ? complen : rawlen);
+    if (complen) {
+        lzinflate(E, data, complen, D->block, rawlen);
+        data = D->block;
+    }
+    D->lz = DECLZ_BLOCK;
+    decfeed(E, L, D, data, rawlen);
+    D->lz = DECLZ_FRAME;
+}
+
+
+/*
+** Takes the frame starting at B, directly if it's all there and through
+** the frame buffer otherwise.
+*/
+static size_t decframe(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    losdec_part* P = &D->frame;
+    size_t rawlen;
+    size_t complen;
+    if (P->len == 0) {
+        size_t n = lzframelen(E, B, len, &rawlen, &complen);
+        if (n != 0 && n <= len) {
+            decblock(E, L, D, B, n);
+            return n;
+        }
+    }
+    size_t pos = 0;
+    while (P->need == 0) {
+        if (pos == len) {
+            return pos;
+        }
+        decpartadd(L, D, P, DECUV_FRAME, B + pos, 1);
+        ++pos;
+        P->need = lzframelen(E, P->b, P->len, &rawlen, &complen);
+    }
+    size_t take = P->need - P->len;
+    if (take > len - pos) {
+        take = len - pos;
+    }
+    decpartadd(L, D, P, DECUV_FRAME, B + pos, take);
+    pos += take;
+    if (P->len == P->need) {
+        size_t n = P->len;
+        P->len = 0;
+        P->need = 0;
+        decblock(E, L, D, P->b, n);
+    }
+    return pos;
+}
+
+
+static void decfeed(jmp_buf E, lua_State* L, losdec* D, const char* B, size_t len)
+{
+    lua_State* T = D->T;
+    size_t pos = 0;
+    if (D->part.len > 0 && D->lz != DECLZ_FRAME) {
+        pos = decpart(E, L, D, B, len);
+    }
+    while (pos < len) {
+        if (D->lz == DECLZ_FRAME) {
+            pos += decframe(E, L, D, B + pos, len - pos);
+            continue;
+        }
+        if (D->skip > 0) {
+            size_t n = D->skip < len - pos ? D->skip : len - pos;
+            D->skip -= n;
+            D->off += n;
+            pos += n;
+            continue;
+        }
+        luaL_checkstack(T, 4, NULL);
+        uint8_t c = (uint8_t)B[pos];
+        losdec_frame* f = D->depth > 0 ? &D->frames[D->depth - 1] : NULL;
+        if (f && f->phase == DEC_ELEM) {
+            size_t n = decelems(E, D, B + pos, len - pos);
+            if (n == 0) {
+                D->part.need = arrwidth[f->narr];
+                decpartadd(L, D, &D->part, DECUV_PART, B + pos, len - pos);
+                D->off += len - pos;
+                return;
+            }
+            D->off += n;
+            pos += n;
+            continue;
+        }
+        if (f && f->phase == DEC_BEGIN) {
+            if (c == SIGN_TBLSIZ) {
+                f->phase = DEC_NARR;
+                ++D->off;
+                ++pos;
+                continue;
+            }
+            lua_createtable(T, 0, 0);
+            tbldef(T, &D->C);
+            f->phase = DEC_ARRAY;
+        }
+        switch (c)
+        {
+        case SIGN_TBLBEG: {
+            decpush(L, D);
+            ++D->off;
+            ++pos;
+            break;
+        }
+        case SIGN_TBLSEP: {
+            if (!f || f->phase != DEC_ARRAY) {
+                los_throw(E, LOS_ESIGN);
+            }
+            f->phase = DEC_HVAL;
+            ++D->off;
+            ++pos;
+            break;
+        }
+        case SIGN_TBLEND: {
+            if (!f || f->phase != DEC_HVAL) {
+                los_throw(E, LOS_ESIGN);
+            }
+            ++D->off;
+            ++pos;
+            if (f->end != 0) {
+                if (f->end < D->off + 8) {
+                    los_throw(E, LOS_ESIGN);
+                }
+                D->skip = f->end - D->off;
+            }
+            --D->depth;
+            decvalue(E, D);
+            break;
+        }
+        default: {
+            size_t n = dechead(E, B + pos, len - pos, D->swap);
+            if (n == 0 || n > len - pos) {
+                D->part.need = n;
+                decpartadd(L, D, &D->part, DECUV_PART, B + pos, len - pos);
+                D->off += len - pos;
+                return;
+            }
+            D->off += n;
+            pos += n;
+            if (decload(E, L, D, B + pos - n, n)) {
+                decvalue(E, D);
+            }
+        }
+        }
+    }
+}
+
+
+typedef void (*losdec_run)(jmp_buf E, lua_State* L, losdec* D);
+
+
+/*
+** Runs run on the decoder's thread, whose stack holds the parse state.
+** Inside, the thread stands in for the caller's state and the decoder
+** is reached through the upvalue of the call.
+*/
+static int decprotect(lua_State* T, losdec_run run)
+{
+    losdec* D = lua_touserdata(T, lua_upvalueindex(1));
+    D->self = lua_upvalueindex(1);
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err == 0) {
+        run(E, T, D);
+    }
+    D->err = err;
+    return lua_gettop(T);
+}
+
+
+static void decrunfeed(jmp_buf E, lua_State* T, losdec* D)
+{
+    decfeed(E, T, D, D->in, D->inlen);
+}
+
+
+static int decfeedp(lua_State* T)
+{
+    return decprotect(T, decrunfeed);
+}
+
+
+static void decrunlz(jmp_buf E, lua_State* T, losdec* D)
+{
+    while (D->lz != DECLZ_OFF) {
+        size_t rawlen;
+        size_t complen;
+        size_t n = lzframelen(E, D->in + D->inpos, D->inlen - D->inpos, &rawlen, &complen);
+        if (n == 0 || n > D->inlen - D->inpos) {
+            los_throw(E, LOS_ESRC);
+        }
+        decblock(E, T, D, D->in + D->inpos, n);
+        D->inpos += n;
+    }
+    if (D->done != 1) {
+        los_throw(E, LOS_ESRC);
+    }
+}
+
+
+static int declzp(lua_State* T)
+{
+    return decprotect(T, decrunlz);
+}
+
+
+/*
+** Calls f on the thread of the decoder at idx over B, returning the
+** error it failed with or 0.
+*/
+static int decrun(lua_State* L, losdec* D, int idx, lua_CFunction f, const char* B, size_t len)
+{
+    lua_State* T = D->T;
+    if (!lua_checkstack(T, 2)) {
+        return LOS_EMEM;
+    }
+    D->in = B;
+    D->inlen = len;
+    D->inpos = 0;
+    D->err = 0;
+    lua_pushvalue(L, idx);
+    lua_pushcclosure(L, f, 1);
+    lua_xmove(L, T, 1);
+    lua_insert(T, 1);
+    int status = lua_pcall(T, lua_gettop(T) - 1, LUA_MULTRET, 0);
+    D->in = NULL;
+    if (status != LUA_OK) {
+        lua_settop(T, 0);
+        return status == LUA_ERRMEM ? LOS_EMEM : LOS_ESIGN;
+    }
+    return D->err;
+}
+
+
+static void decreset(losdec* D)
+{
+    lua_settop(D->T, 0);
+    lua_newtable(D->T);
+    lua_newtable(D->T);
+    lua_newtable(D->T);
+    D->C.flags = 0;
+    D->C.strs = 1;
+    D->C.tbls = 2;
+    D->C.shapes = 3;
+    D->C.nstr = 0;
+    D->C.ntbl = 0;
+    D->C.nshape = 0;
+    D->err = 0;
+    D->busy = 0;
+    D->depth = 0;
+    D->part.len = 0;
+    D->part.need = 0;
+    D->frame.len = 0;
+    D->frame.need = 0;
+    D->lz = DECLZ_OFF;
+    D->done = 0;
+    D->off = 0;
+    D->skip = 0;
+}
+
+
+static int los_decoder_feed(lua_State* L)
+{
+    losdec* D = luaL_checkudata(L, 1, LOSDEC_META);
+    const char* B;
+    size_t size;
+    if (lua_islightuserdata(L, 2)) {
+        B = lua_touserdata(L, 2);
+        size = luaL_checkinteger(L, 3);
+    }
+    else {
+        B = luaL_checklstring(L, 2, &size);
+    }
+    if (D->busy) {
+        D->err = LOS_ESIGN;
+    }
+    if (D->err != 0) {
+        lua_pushinteger(L, D->err);
+        return 1;
+    }
+    D->busy = 1;
+    D->done = 0;
+    int err = decrun(L, D, 1, decfeedp, B, size);
+    D->busy = 0;
+    if (err != 0) {
+        D->err = err;
+        lua_pushinteger(L, err);
+        return 1;
+    }
+    int done = D->done;
+    luaL_checkstack(L, done + 1, NULL);
+    lua_pushinteger(L, done);
+    lua_rotate(D->T, 4, -done);
+    lua_xmove(D->T, L, done);
+    return done + 1;
+}
+
+
+static int los_decoder_reset(lua_State* L)
+{
+    losdec* D = luaL_checkudata(L, 1, LOSDEC_META);
+    decreset(D);
+    return 0;
+}
+
+
+static int newdecoder(lua_State* L, int swap)
+{
+    losdec* D = lua_newuserdatauv(L, sizeof(losdec), 5);
+    D->T = lua_newthread(L);
+    lua_setiuservalue(L, -2, DECUV_THREAD);
+    D->maxdepth = 16;
+    D->frames = lua_newuserdatauv(L, D->maxdepth * sizeof(losdec_frame), 0);
+    lua_setiuservalue(L, -2, DECUV_FRAMES);
+    D->swap = swap;
+    D->part.b = NULL;
+    D->part.cap = 0;
+    D->frame.b = NULL;
+    D->frame.cap = 0;
+    D->block = NULL;
+    D->in = NULL;
+    D->self = 0;
+    decreset(D);
+    luaL_setmetatable(L, LOSDEC_META);
+    return 1;
+}
+
+
+/*
+** Loads a compressed object for load, running its frames through a
+** decoder of its own and leaving the object in the decoder's place.
+*/
+static size_t lzload(jmp_buf E, lua_State* L, const char* B, size_t buflen, losctx* C, int swap)
+{
+    luaL_checkstack(L, 3, NULL);
+    newdecoder(L, swap);
+    losdec* D = lua_touserdata(L, -1);
+    D->block = lua_newuserdatauv(L, LZ_BLOCK, 0);
+    lua_setiuservalue(L, -2, DECUV_BLOCK);
+    D->C.flags = C->flags & ~FLAG_LZ;
+    D->lz = DECLZ_FRAME;
+    int err = decrun(L, D, lua_gettop(L), declzp, B, buflen);
+    if (err != 0) {
+        los_throw(E, err);
+    }
+    lua_xmove(D->T, L, 1);
+    lua_replace(L, -2);
+    return D->inpos;
+}
+
+
+static int los_decoder(lua_State* L)
+{
+    return newdecoder(L, 0);
+}
+
+
+static int los_decoder_x(lua_State* L)
+{
+    return newdecoder(L, 1);
+}
+
+
+/*
+** Lazy views. A view stands for a table of the binary format without
+** decoding it: indexing it scans the table's encoding for the key,
+** skipping the items in front of it, and decodes only the value found,
+** which is a view again when it is a table. Packed arrays are indexed
+** directly. The view keeps the source string alive in its user value;
+** a view over a lightuserdata buffer leaves that to the caller. The
+** position of the last array item reached is cached, so walking an array
+** in order stays linear. A table written with index on is looked up
+** through its footer instead of scanned.
+**
+** Strings, tables and shapes written by dedup, refs and shapes depend on
+** everything written before them, so objects written with those options
+** or compressed are loaded instead. Columnar blocks are loaded whole when
+** they are reached.
+*/
+#define LOSVIEW_META "los.view"
+
+#define view_try(E) do {                                            \
+    int err = setjmp(E);                                            \
+    if (err != 0) {                                                 \
+        return luaL_error(L, "invalid data in los view (%d)", err); \
+    }                                                               \
+} while (0)
+
+typedef struct losview
+{
+    const char* B;
+    size_t len;
+    int    swap;
+    int    flags;
+    lua_Integer idx;
+    size_t pos;
+    const char* F;
+    size_t narr;
+    size_t nrec;
+} losview;
+
+
+/*
+** Length of the whole value at B, tables included.
+*/
+static size_t skipvalue(jmp_buf E, const char* B, size_t buflen, int swap)
+{
+    size_t pos = 0;
+    size_t depth = 0;
+    do {
+        checksrclen(buflen - pos, 1);
+        switch ((uint8_t)B[pos])
+        {
+        case SIGN_TBLBEG: {
+            ++depth;
+            ++pos;
+            break;
+        }
+        case SIGN_TBLEND: {
+            if (depth == 0) {
+                los_throw(E, LOS_ESIGN);
+            }
+            --depth;
+            ++pos;
+            break;
+        }
+        case SIGN_TBLSEP:
+        case SIGN_TBLSIZ: {
+            if (depth == 0) {
+                los_throw(E, LOS_ESIGN);
+            }
+            ++pos;
+            break;
+        }
+        default: {
+            size_t n = itemlen(E, B + pos, buflen - pos, swap);
+            if (n == 0 || n > buflen - pos) {
+                los_throw(E, LOS_ESRC);
+            }
+            pos += n;
+        }
+        }
+    } while (depth > 0);
+    return pos;
+}
+
+
+/*
+** Tells whether the item of n bytes at B is a string, and where its
+** bytes are.
+*/
+static int viewstr(jmp_buf E, const char* B, size_t n, int swap, const char** s, size_t* len)
+{
+    uint8_t c = (uint8_t)B[0];
+    if (IS_SHRSTR(c)) {
+        *s = B + 1;
+        *len = c & ~MASK_SHRSTR;
+        return 1;
+    }
+    switch (c)
+    {
+    case SIGN_STR1: {
+        *s = B + 2;
+        *len = (uint8_t)B[1];
+        return 1;
+    }
+    case SIGN_STR2: {
+        *s = B + 3;
+        *len = get16(B + 1, swap);
+        return 1;
+    }
+    case SIGN_STR4: {
+        *s = B + 5;
+        *len = get32(B + 1, swap);
+        return 1;
+    }
+    case SIGN_VSTR: {
+        uint64_t v;
+        size_t h = 1 + getvarint(E, B + 1, n - 1, &v);
+        *s = B + h;
+        *len = (size_t)v;
+        return 1;
+    }
+    }
+    return 0;
+}
+
+
+#define isview(c) ((c) == SIGN_TBLBEG || (c) == SIGN_ARRAY || (c) == SIGN_INDEX)
+
+#define VIEW_FLAGS (FLAG_VARINT | FLAG_COLUMN | FLAG_INDEX | FLAG_TBLSIZ)
+
+#define VIEW_NONE 0
+#define VIEW_ITEM 1
+#define VIEW_ELEM 2
+
+
+/*
+** Sets V up over the table at B. The view of an indexed table covers the
+** plain table inside and keeps where its footer is.
+*/
+static void viewinit(jmp_buf E, losview* V, const char* B, size_t len, int swap, int flags)
+{
+    V->B = B;
+    V->len = len;
+    V->swap = swap;
+    V->flags = flags;
+    V->idx = 0;
+    V->pos = 0;
+    V->F = NULL;
+    V->narr = 0;
+    V->nrec = 0;
+    if ((uint8_t)B[0] == SIGN_INDEX) {
+        uint64_t n;
+        size_t h = 1 + getvarint(E, B + 1, len - 1, &n);
+        checksrclen(len - h, n);
+        checksrclen(n, 8);
+        const char* end = B + h + n;
+        V->narr = get32(end - 8, swap);
+        V->nrec = get32(end - 4, swap);
+        size_t foot = 8 + (uint64_t)V->narr * 4 + (uint64_t)V->nrec * 12;
+        if (foot > n || (uint8_t)B[h] != SIGN_TBLBEG) {
+            los_throw(E, LOS_ESIGN);
+        }
+        V->B = B + h;
+        V->len = n - foot;
+        V->F = end - foot;
+    }
+}
+
+
+/*
+** Pushes a view of the table at B, taking the owner of the source from
+** the top of the stack.
+*/
+static void newview(jmp_buf E, lua_State* L, const char* B, size_t len, int swap, int flags)
+{
+    losview* V = lua_newuserdatauv(L, sizeof(losview), 1);
+    viewinit(E, V, B, len, swap, flags);
+    lua_rotate(L, -2, 1);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, LOSVIEW_META);
+}
+
+
+/*
+** Decodes the value at pos in full.
+*/
+static void viewload(jmp_buf E, lua_State* L, losview* V, size_t pos)
+{
+    luaL_checkstack(L, 3, NULL);
+    checksrclen(V->len - pos, 1);
+    losctx C;
+    ctxinit(L, &C, V->flags);
+    loadnext(V->swap)(E, L, V->B + pos, V->len - pos, &C);
+}
+
+
+/*
+** Pushes the value at pos of the view at stack index 1.
+*/
+static void viewpush(jmp_buf E, lua_State* L, losview* V, size_t pos)
+{
+    checksrclen(V->len - pos, 1);
+    if (isview((uint8_t)V->B[pos])) {
+        luaL_checkstack(L, 2, NULL);
+        lua_getiuservalue(L, 1, 1);
+        newview(E, L, V->B + pos, V->len - pos, V->swap, V->flags);
+        return;
+    }
+    viewload(E, L, V, pos);
+}
+
+
+/*
+** Position of the first array item of a table view.
+*/
+static size_t viewfirst(jmp_buf E, losview* V)
+{
+    checksrclen(V->len, 2);
+    if ((uint8_t)V->B[1] != SIGN_TBLSIZ) {
+        return 1;
+    }
+    size_t pos = 2;
+    pos += skipvalue(E, V->B + pos, V->len - pos, V->swap);
+    pos += skipvalue(E, V->B + pos, V->len - pos, V->swap);
+    return pos;
+}
+
+
+/*
+** Reads the header of a packed array view, returning the position of
+** its data.
+*/
+static size_t viewarray(jmp_buf E, losview* V, int* type, size_t* narr)
+{
+    checksrclen(V->len, 2);
+    *type = (uint8_t)V->B[1];
+    if (*type < ARR_F64 || *type > ARR_BOOL) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t n;
+    size_t pos = 2 + getvarint(E, V->B + 2, V->len - 2, &n);
+    if (n > (V->len - pos) * 8 || arraylen(n, *type) > V->len - pos) {
+        los_throw(E, LOS_ESRC);
+    }
+    *narr = (size_t)n;
+    return pos;
+}
+
+
+static void arrayget(lua_State* L, const char* p, size_t i, int type, int swap)
+{
+    switch (type)
+    {
+    case ARR_F64: {
+        uint64_t u = get64(p + i * 8, swap);
+        double d;
+        memcpy(&d, &u, 8);
+        lua_pushnumber(L, d);
+        break;
+    }
+    case ARR_I8: {
+        lua_pushinteger(L, (int8_t)p[i]);
+        break;
+    }
+    case ARR_I16: {
+        lua_pushinteger(L, (int16_t)get16(p + i * 2, swap));
+        break;
+    }
+    case ARR_I32: {
+        lua_pushinteger(L, (int32_t)get32(p + i * 4, swap));
+        break;
+    }
+    case ARR_I64: {
+        lua_pushinteger(L, (lua_Integer)get64(p + i * 8, swap));
+        break;
+    }
+    default: {
+        lua_pushboolean(L, ((uint8_t)p[i / 8] >> (i % 8)) & 1);
+    }
+    }
+}
+
+
+/*
+** Tells whether the key of n bytes at pos equals the value at stack
+** index key. String keys are compared in place.
+*/
+static int viewkey(jmp_buf E, lua_State* L, losview* V, size_t pos, size_t n, int key)
+{
+    const char* s;
+    size_t len;
+    int isstr = viewstr(E, V->B + pos, n, V->swap, &s, &len);
+    if (lua_type(L, key) == LUA_TSTRING) {
+        size_t klen;
+        const char* k = lua_tolstring(L, key, &klen);
+        return isstr && len == klen && memcmp(s, k, len) == 0;
+    }
+    uint8_t c = (uint8_t)V->B[pos];
+    if (isstr || isview(c) || c == SIGN_COLUMNS) {
+        return 0;
+    }
+    viewload(E, L, V, pos);
+    int eq = lua_rawequal(L, -1, key);
+    lua_pop(L, 1);
+    return eq;
+}
+
+
+/*
+** Looks the key at stack index key up through the footer of an indexed
+** view, k being the key as an integer or 0.
+*/
+static int viewlookup(jmp_buf E, lua_State* L, losview* V, int key, lua_Integer k, size_t* pos)
+{
+    if (k >= 1 && (lua_Unsigned)k <= V->narr) {
+        *pos = get32(V->F + (k - 1) * 4, V->swap);
+        checksrclen(V->len, *pos + 1);
+        return VIEW_ITEM;
+    }
+    const char* H = V->F + V->narr * 4;
+    uint32_t hash = keyhash(L, key);
+    size_t lo = 0;
+    size_t hi = V->nrec;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (get32(H + mid * 12, V->swap) < hash) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    for (; lo < V->nrec && get32(H + lo * 12, V->swap) == hash; ++lo) {
+        size_t kpos = get32(H + lo * 12 + 4, V->swap);
+        size_t vpos = get32(H + lo * 12 + 8, V->swap);
+        if (kpos >= V->len || vpos >= V->len) {
+            los_throw(E, LOS_ESIGN);
+        }
+        size_t n = skipvalue(E, V->B + kpos, V->len - kpos, V->swap);
+        if (viewkey(E, L, V, kpos, n, key)) {
+            *pos = vpos;
+            return VIEW_ITEM;
+        }
+    }
+    return VIEW_NONE;
+}
+
+
+/*
+** Finds the item under the key at stack index key. It is either an
+** encoded value at *pos, or item *pos of a packed array. In the hash
+** part each value comes before its key.
+*/
+static int viewfind(jmp_buf E, lua_State* L, losview* V, int key, size_t* pos)
+{
+    lua_Integer k = 0;
+    if (lua_type(L, key) == LUA_TNUMBER) {
+        k = lua_tointegerx(L, key, NULL);
+    }
+    if ((uint8_t)V->B[0] == SIGN_ARRAY) {
+        int type;
+        size_t narr;
+        viewarray(E, V, &type, &narr);
+        if (k >= 1 && (lua_Unsigned)k <= narr) {
+            *pos = (size_t)k - 1;
+            return VIEW_ELEM;
+        }
+        return VIEW_NONE;
+    }
+    if (V->F) {
+        return viewlookup(E, L, V, key, k, pos);
+    }
+    const char* B = V->B;
+    size_t p;
+    lua_Integer i;
+    if (k >= 1 && V->idx >= 1 && k >= V->idx) {
+        p = V->pos;
+        i = V->idx;
+    }
+    else {
+        p = viewfirst(E, V);
+        i = 1;
+    }
+    for (;;) {
+        checksrclen(V->len - p, 1);
+        if ((uint8_t)B[p] == SIGN_TBLSEP) {
+            break;
+        }
+        if (i == k) {
+            V->idx = i;
+            V->pos = p;
+            *pos = p;
+            return VIEW_ITEM;
+        }
+        p += skipvalue(E, B + p, V->len - p, V->swap);
+        ++i;
+    }
+    ++p;
+    for (;;) {
+        checksrclen(V->len - p, 1);
+        if ((uint8_t)B[p] == SIGN_TBLEND) {
+            break;
+        }
+        size_t n = skipvalue(E, B + p, V->len - p, V->swap);
+        size_t m = skipvalue(E, B + p + n, V->len - p - n, V->swap);
+        if (viewkey(E, L, V, p + n, m, key)) {
+            *pos = p;
+            return VIEW_ITEM;
+        }
+        p += n + m;
+    }
+    return VIEW_NONE;
+}
+
+
+static void viewelem(jmp_buf E, lua_State* L, losview* V, size_t i)
+{
+    int type;
+    size_t narr;
+    size_t pos = viewarray(E, V, &type, &narr);
+    arrayget(L, V->B + pos, i, type, V->swap);
+}
+
+
+static int los_view_index(lua_State* L)
+{
+    losview* V = luaL_checkudata(L, 1, LOSVIEW_META);
+    jmp_buf E;
+    view_try(E);
+    size_t pos;
+    switch (viewfind(E, L, V, 2, &pos))
+    {
+    case VIEW_ITEM: {
+        viewpush(E, L, V, pos);
+        break;
+    }
+    case VIEW_ELEM: {
+        viewelem(E, L, V, pos);
+        break;
+    }
+    default: {
+        lua_pushnil(L);
+    }
+    }
+    return 1;
+}
+
+
+static int los_view_len(lua_State* L)
+{
+    losview* V = luaL_checkudata(L, 1, LOSVIEW_META);
+    jmp_buf E;
+    view_try(E);
+    if ((uint8_t)V->B[0] == SIGN_ARRAY) {
+        int type;
+        size_t narr;
+        viewarray(E, V, &type, &narr);
+        lua_pushinteger(L, (lua_Integer)narr);
+        return 1;
+    }
+    if (V->F) {
+        lua_pushinteger(L, (lua_Integer)V->narr);
+        return 1;
+    }
+    checksrclen(V->len, 2);
+    if ((uint8_t)V->B[1] == SIGN_TBLSIZ) {
+        viewpush(E, L, V, 2);
+        return 1;
+    }
+    size_t pos = 1;
+    lua_Integer n = 0;
+    for (;;) {
+        checksrclen(V->len - pos, 1);
+        if ((uint8_t)V->B[pos] == SIGN_TBLSEP) {
+            break;
+        }
+        pos += skipvalue(E, V->B + pos, V->len - pos, V->swap);
+        ++n;
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+
+/*
+** Iterator of pairs. Its upvalues are the position of the next item and
+** the index of the next array item, 0 once in the hash part.
+*/
+static int los_view_next(lua_State* L)
+{
+    losview* V = luaL_checkudata(L, 1, LOSVIEW_META);
+    jmp_buf E;
+    view_try(E);
+    size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(1));
+    lua_Integer i = lua_tointeger(L, lua_upvalueindex(2));
+    if ((uint8_t)V->B[0] == SIGN_ARRAY) {
+        int type;
+        size_t narr;
+        pos = viewarray(E, V, &type, &narr);
+        if ((lua_Unsigned)i > narr) {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_pushinteger(L, i + 1);
+        lua_replace(L, lua_upvalueindex(2));
+        lua_pushinteger(L, i);
+        arrayget(L, V->B + pos, (size_t)i - 1, type, V->swap);
+        return 2;
+    }
+    checksrclen(V->len - pos, 1);
+    while (i > 0 && (uint8_t)V->B[pos] == SIGN_NIL) {
+        ++i;
+        ++pos;
+        checksrclen(V->len - pos, 1);
+    }
+    if (i > 0 && (uint8_t)V->B[pos] == SIGN_TBLSEP) {
+        i = 0;
+        ++pos;
+        checksrclen(V->len - pos, 1);
+    }
+    if (i == 0 && (uint8_t)V->B[pos] == SIGN_TBLEND) {
+        lua_pushnil(L);
+        return 1;
+    }
+    size_t n = skipvalue(E, V->B + pos, V->len - pos, V->swap);
+    if (i > 0) {
+        lua_pushinteger(L, i);
+        viewpush(E, L, V, pos);
+        ++i;
+    }
+    else {
+        size_t k = skipvalue(E, V->B + pos + n, V->len - pos - n, V->swap);
+        viewpush(E, L, V, pos + n);
+        viewpush(E, L, V, pos);
+        n += k;
+    }
+    lua_pushinteger(L, (lua_Integer)(pos + n));
+    lua_replace(L, lua_upvalueindex(1));
+    lua_pushinteger(L, i);
+    lua_replace(L, lua_upvalueindex(2));
+    return 2;
+}
+
+
+static int los_view_pairs(lua_State* L)
+{
+    losview* V = luaL_checkudata(L, 1, LOSVIEW_META);
+    jmp_buf E;
+    view_try(E);
+    size_t pos = (uint8_t)V->B[0] == SIGN_ARRAY ? 0 : viewfirst(E, V);
+    lua_pushinteger(L, (lua_Integer)pos);
+    lua_pushinteger(L, 1);
+    lua_pushcclosure(L, los_view_next, 2);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+
+static int viewvalue(lua_State* L, int swap)
+{
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 1);
+    const char* B;
+    size_t size;
+    if (lua_islightuserdata(L, 1)) {
+        B = lua_touserdata(L, 1);
+        size = luaL_checkinteger(L, 2);
+        lua_settop(L, 2);
+        lua_pushnil(L);
+    }
+    else {
+        luaL_argexpected(L, lua_isstring(L, 1), 1, lua_typename(L, LUA_TSTRING));
+        lua_settop(L, 1);
+        B = lua_tolstring(L, 1, &size);
+        lua_pushvalue(L, 1);
+    }
+    int flags;
+    size_t pos = readhdr(E, B, size, &flags);
+    if (flags & ~VIEW_FLAGS) {
+        lua_pop(L, 1);
+        loadvalue(L, swap);
+        return 1;
+    }
+    checksrclen(size - pos, 1);
+    if (isview((uint8_t)B[pos])) {
+        newview(E, L, B + pos, size - pos, swap, flags);
+        return 1;
+    }
+    losctx C;
+    ctxinit(L, &C, flags);
+    loadnext(swap)(E, L, B + pos, size - pos, &C);
+    return 1;
+}
+
+
+static int los_view(lua_State* L)
+{
+    return viewvalue(L, 0);
+}
+
+
+static int los_view_x(lua_State* L)
+{
+    return viewvalue(L, 1);
+}
+
+
+/*
+** Extraction by key path. The path is walked over the serialized object
+** with the lookups of views, skipping the items off the path by their
+** length, and only the value at its end is decoded. Objects a view can't
+** read in place, and columnar arrays met on the way, are loaded and the
+** rest of the path is walked over the loaded tables.
+*/
+static void getpath(lua_State* L, int i, int top)
+{
+    for (; i <= top; ++i) {
+        if (!lua_istable(L, -1)) {
+            lua_pushnil(L);
+            return;
+        }
+        lua_pushvalue(L, i);
+        lua_rawget(L, -2);
+    }
+}
+
+
+static int getvalue(lua_State* L, int swap)
+{
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 1);
+    const char* B;
+    size_t size;
+    int path;
+    if (lua_islightuserdata(L, 1)) {
+        B = lua_touserdata(L, 1);
+        size = luaL_checkinteger(L, 2);
+        path = 3;
+    }
+    else {
+        luaL_argexpected(L, lua_isstring(L, 1), 1, lua_typename(L, LUA_TSTRING));
+        B = lua_tolstring(L, 1, &size);
+        path = 2;
+    }
+    int top = lua_gettop(L);
+    int flags;
+    size_t pos = readhdr(E, B, size, &flags);
+    losctx C;
+    if (flags & ~VIEW_FLAGS) {
+        ctxinit(L, &C, flags);
+        if (flags & FLAG_LZ) {
+            lzload(E, L, B + pos, size - pos, &C, swap);
+        }
+        else {
+            loadnext(swap)(E, L, B + pos, size - pos, &C);
+        }
+        getpath(L, path, top);
+        return 1;
+    }
+    B += pos;
+    size -= pos;
+    losview V;
+    for (int i = path; i <= top; ++i) {
+        checksrclen(size, 1);
+        uint8_t c = (uint8_t)B[0];
+        if (c == SIGN_COLUMNS) {
+            ctxinit(L, &C, flags);
+            loadnext(swap)(E, L, B, size, &C);
+            getpath(L, i, top);
+            return 1;
+        }
+        if (!isview(c)) {
+            lua_pushnil(L);
+            return 1;
+        }
+        viewinit(E, &V, B, size, swap, flags);
+        size_t at;
+        switch (viewfind(E, L, &V, i, &at))
+        {
+        case VIEW_ITEM: {
+            B = V.B + at;
+            size = V.len - at;
+            break;
+        }
+        case VIEW_ELEM: {
+            if (i < top) {
+                lua_pushnil(L);
             }
-            else if (INT8_MIN <= v && v <= INT8_MAX) {
-                checkdestlen(buflen, 2);
-                int8_t i = (int8_t)v;
-                B[0] = SIGN_INT1;
-                B[1] = i;
-                return 2;
+            else {
+                viewelem(E, L, &V, at);
             }
-            else if (INT16_MIN <= v && v <= INT16_MAX) {
-                checkdestlen(buflen, 3);
-                int16_t i = (int16_t)v;
-                B[0] = SIGN_INT2;
-                B[1] = *(char*)&i;
-                B[2] = *((char*)&i + 1);
-                return 3;
+            return 1;
+        }
+        default: {
+            lua_pushnil(L);
+            return 1;
+        }
+        }
+    }
+    checksrclen(size, 1);
+    ctxinit(L, &C, flags);
+    loadnext(swap)(E, L, B, size, &C);
+    return 1;
+}
+
+
+static int los_get(lua_State* L)
+{
+    return getvalue(L, 0);
+}
+
+
+static int los_get_x(lua_State* L)
+{
+    return getvalue(L, 1);
+}
+
+
+/*
+** Structural scanner. validate and length walk the binary format without
+** creating any Lua value: validate checks everything load would, down to
+** the reference numbers and the content of columnar, indexed and
+** compressed blocks, while length checks the signs, the bounds and the
+** nesting of tables and skips blocks and compressed frames by their
+** length, which is enough to find where an object ends. Both return the
+** length of the object, or an error code and the offset of the item at
+** fault. The only memory they take is a buffer for the key counts of
+** shapes and, when validating a compressed object, one for its blocks;
+** a fault inside the blocks is reported at the offset of its frame.
+*/
+#define SCAN_MAXDEPTH 1000
+
+typedef struct losscan
+{
+    const char* at;
+    int    swap;
+    int    flags;
+    int    deep;
+    int    depth;
+    uint64_t nstr;
+    uint64_t ntbl;
+    losbuf shapes;
+    losbuf raw;
+    losbuf frames;
+    const char* lz;
+} losscan;
+
+
+#define isstrsign(c) (IS_SHRSTR(c) || (c) == SIGN_STR1 || (c) == SIGN_STR2 || \
+                      (c) == SIGN_STR4 || (c) == SIGN_VSTR || (c) == SIGN_STRREF)
+
+#define scanfail(E, S, p, err) ((S)->at = (p), los_throw(E, err))
+
+
+static size_t scannext(jmp_buf E, losscan* S, const char* B, size_t buflen);
+
+
+/*
+** Reads an integer item, failing on any other item.
+*/
+static size_t readint(jmp_buf E, const char* B, size_t buflen, int swap, int64_t* v)
+{
+    checksrclen(buflen, 1);
+    uint8_t c = (uint8_t)B[0];
+    if (IS_SHRINT(c)) {
+        *v = (int8_t)c;
+        return 1;
+    }
+    switch (c)
+    {
+    case SIGN_INT1: {
+        checksrclen(buflen, 2);
+        *v = (int8_t)B[1];
+        return 2;
+    }
+    case SIGN_INT2: {
+        checksrclen(buflen, 3);
+        *v = (int16_t)get16(B + 1, swap);
+        return 3;
+    }
+    case SIGN_INT4: {
+        checksrclen(buflen, 5);
+        *v = (int32_t)get32(B + 1, swap);
+        return 5;
+    }
+    case SIGN_INT8: {
+        checksrclen(buflen, 9);
+        *v = (int64_t)get64(B + 1, swap);
+        return 9;
+    }
+    case SIGN_VINT: {
+        uint64_t z;
+        size_t n = 1 + getvarint(E, B + 1, buflen - 1, &z);
+        *v = unzigzag(z);
+        return n;
+    }
+    }
+    los_throw(E, LOS_ESIGN);
+    return 0;
+}
+
+
+static size_t scanint(jmp_buf E, losscan* S, const char* B, size_t buflen, int64_t* v)
+{
+    S->at = B;
+    return readint(E, B, buflen, S->swap, v);
+}
+
+
+/*
+** Fails on a key Lua can't index with: nil or NaN.
+*/
+static void scankey(jmp_buf E, losscan* S, const char* B)
+{
+    uint8_t c = (uint8_t)B[0];
+    int bad = c == SIGN_NIL;
+    if (c == SIGN_FLT) {
+        uint64_t u = get64(B + 1, S->swap);
+        double d;
+        memcpy(&d, &u, 8);
+        bad = d != d;
+    }
+    if (bad) {
+        scanfail(E, S, B, LOS_ESIGN);
+    }
+}
+
+
+static size_t scantable(jmp_buf E, losscan* S, const char* B, size_t buflen)
+{
+    if (++S->depth > SCAN_MAXDEPTH) {
+        los_throw(E, LOS_ESIGN);
+    }
+    ++S->ntbl;
+    size_t total = 1;
+    if (buflen > 1 && (uint8_t)B[1] == SIGN_TBLSIZ) {
+        ++total;
+        for (int i = 0; i < 2; ++i) {
+            int64_t n;
+            total += scanint(E, S, B + total, buflen - total, &n);
+            if (n < 0) {
+                los_throw(E, LOS_ESIGN);
             }
-            else if (INT32_MIN <= v && v <= INT32_MAX) {
-                checkdestlen(buflen, 5);
-                int32_t i = (int32_t)v;
-                B[0] = SIGN_INT4;
-                B[1] = *(char*)&i;
-                B[2] = *((char*)&i + 1);
-                B[3] = *((char*)&i + 2);
-                B[4] = *((char*)&i + 3);
-                return 5;
+        }
+    }
+    size_t n;
+    while (n = scannext(E, S, B + total, buflen - total)) {
+        total += n;
+    }
+    if ((uint8_t)B[total] != SIGN_TBLSEP) {
+        scanfail(E, S, B + total, LOS_ESIGN);
+    }
+    ++total;
+    while (n = scannext(E, S, B + total, buflen - total)) {
+        total += n;
+        const char* key = B + total;
+        n = scannext(E, S, key, buflen - total);
+        if (n == 0) {
+            scanfail(E, S, key, LOS_ESIGN);
+        }
+        if (S->deep) {
+            scankey(E, S, key);
+        }
+        total += n;
+    }
+    if ((uint8_t)B[total] != SIGN_TBLEND) {
+        scanfail(E, S, B + total, LOS_ESIGN);
+    }
+    --S->depth;
+    return total + 1;
+}
+
+
+/*
+** Shapes are checked the way load reads them, which needs the key count
+** of every shape defined so far.
+*/
+static size_t scanshape(jmp_buf E, losscan* S, const char* B, size_t buflen)
+{
+    if (!(S->flags & FLAG_SHAPE)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t v;
+    size_t total = 1 + getvarint(E, B + 1, buflen - 1, &v);
+    if ((uint8_t)B[0] == SIGN_SHPDEF) {
+        if (v == 0) {
+            los_throw(E, LOS_ESIGN);
+        }
+        if (v > (buflen - total) / 2) {
+            los_throw(E, LOS_ESRC);
+        }
+        for (uint64_t i = 0; i < v; ++i) {
+            const char* key = B + total;
+            size_t n = scannext(E, S, key, buflen - total);
+            if (n == 0 || !isstrsign((uint8_t)key[0])) {
+                scanfail(E, S, key, LOS_ESIGN);
             }
-            else {
-                checkdestlen(buflen, 9);
-                B[0] = SIGN_INT8;
-                B[1] = *(char*)&v;
-                B[2] = *((char*)&v + 1);
-                B[3] = *((char*)&v + 2);
-                B[4] = *((char*)&v + 3);
-                B[5] = *((char*)&v + 4);
-                B[6] = *((char*)&v + 5);
-                B[7] = *((char*)&v + 6);
-                B[8] = *((char*)&v + 7);
-                return 9;
+            total += n;
+        }
+        losbuf_addlstring(&S->shapes, (const char*)&v, sizeof(uint64_t));
+    }
+    else {
+        if (v >= S->shapes.n / sizeof(uint64_t)) {
+            los_throw(E, LOS_ESIGN);
+        }
+        memcpy(&v, S->shapes.b + v * sizeof(uint64_t), sizeof(uint64_t));
+    }
+    if (++S->depth > SCAN_MAXDEPTH) {
+        los_throw(E, LOS_ESIGN);
+    }
+    ++S->ntbl;
+    for (uint64_t i = 0; i < v; ++i) {
+        size_t n = scannext(E, S, B + total, buflen - total);
+        if (n == 0) {
+            scanfail(E, S, B + total, LOS_ESIGN);
+        }
+        total += n;
+    }
+    --S->depth;
+    return total;
+}
+
+
+static size_t scancolstr(jmp_buf E, const char* B, size_t buflen)
+{
+    uint64_t len;
+    size_t n = getvarint(E, B, buflen, &len);
+    checksrclen(buflen - n, len);
+    return n + len;
+}
+
+
+static size_t scancolumn(jmp_buf E, losscan* S, const char* B, size_t buflen, uint64_t nrows)
+{
+    S->at = B;
+    checksrclen(buflen, 1);
+    size_t pos = 1;
+    switch (B[0])
+    {
+    case COL_INT: {
+        for (uint64_t i = 0; i < nrows; ++i) {
+            uint64_t z;
+            pos += getvarint(E, B + pos, buflen - pos, &z);
+        }
+        break;
+    }
+    case COL_FLT: {
+        checksrclen((buflen - pos) / 8, nrows);
+        pos += nrows * 8;
+        break;
+    }
+    case COL_BOOL: {
+        checksrclen(buflen - pos, (nrows + 7) / 8);
+        pos += (nrows + 7) / 8;
+        break;
+    }
+    case COL_STR: {
+        for (uint64_t i = 0; i < nrows; ++i) {
+            pos += scancolstr(E, B + pos, buflen - pos);
+        }
+        break;
+    }
+    case COL_DICT: {
+        uint64_t ndict;
+        pos += getvarint(E, B + pos, buflen - pos, &ndict);
+        if (ndict > buflen - pos) {
+            los_throw(E, LOS_ESRC);
+        }
+        for (uint64_t j = 0; j < ndict; ++j) {
+            pos += scancolstr(E, B + pos, buflen - pos);
+        }
+        for (uint64_t i = 0; i < nrows; ++i) {
+            uint64_t idx;
+            pos += getvarint(E, B + pos, buflen - pos, &idx);
+            if (idx >= ndict) {
+                los_throw(E, LOS_ESIGN);
+            }
+        }
+        break;
+    }
+    case COL_ANY: {
+        for (uint64_t i = 0; i < nrows; ++i) {
+            size_t n = scannext(E, S, B + pos, buflen - pos);
+            if (n == 0) {
+                scanfail(E, S, B + pos, LOS_ESIGN);
             }
+            pos += n;
+        }
+        break;
+    }
+    default: {
+        los_throw(E, LOS_ESIGN);
+    }
+    }
+    return pos;
+}
+
+
+/*
+** The items of a columnar block are read with the options of their own,
+** as load does.
+*/
+static size_t scancolumns(jmp_buf E, losscan* S, const char* B, size_t buflen)
+{
+    if (!(S->flags & FLAG_COLUMN)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t len;
+    size_t total = 1 + getvarint(E, B + 1, buflen - 1, &len);
+    checksrclen(buflen - total, len);
+    B += total;
+    int flags = S->flags;
+    uint64_t nstr = S->nstr;
+    uint64_t ntbl = S->ntbl;
+    S->flags = FLAG_COLUMN | FLAG_VARINT;
+    uint64_t nrows;
+    uint64_t nkeys;
+    size_t pos = getvarint(E, B, len, &nrows);
+    pos += getvarint(E, B + pos, len - pos, &nkeys);
+    if (!colsfit(nrows, nkeys, len - pos)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        const char* key = B + pos;
+        size_t n = scannext(E, S, key, len - pos);
+        if (n == 0 || !isstrsign((uint8_t)key[0])) {
+            scanfail(E, S, key, LOS_ESIGN);
+        }
+        pos += n;
+        pos += scancolumn(E, S, B + pos, len - pos, nrows);
+    }
+    if (pos != len) {
+        scanfail(E, S, B + pos, LOS_ESIGN);
+    }
+    S->flags = flags;
+    S->nstr = nstr;
+    S->ntbl = ntbl;
+    return total + len;
+}
+
+
+/*
+** An indexed table must fill its block up to the footer, and the offsets
+** in the footer must fall inside it. Finding the length only, the table
+** is walked for the shapes it defines, which later items may use, and the
+** footer is left alone.
+*/
+static size_t scanindex(jmp_buf E, losscan* S, const char* B, size_t buflen)
+{
+    if (!(S->flags & FLAG_INDEX)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t len;
+    size_t total = 1 + getvarint(E, B + 1, buflen - 1, &len);
+    checksrclen(buflen - total, len);
+    checksrclen(len, 8);
+    const char* T = B + total;
+    const char* end = T + len;
+    uint64_t narr = get32(end - 8, S->swap);
+    uint64_t nrec = get32(end - 4, S->swap);
+    uint64_t foot = 8 + narr * 4 + nrec * 12;
+    if (foot > len || (uint8_t)T[0] != SIGN_TBLBEG) {
+        los_throw(E, LOS_ESIGN);
+    }
+    size_t tlen = (size_t)(len - foot);
+    if (scannext(E, S, T, tlen) != tlen) {
+        scanfail(E, S, T, LOS_ESIGN);
+    }
+    if (!S->deep) {
+        return total + (size_t)len;
+    }
+    const char* F = T + tlen;
+    for (uint64_t i = 0; i < narr + nrec * 3; ++i) {
+        if (i >= narr && (i - narr) % 3 == 0) {
+            continue;
         }
-        else {
-            checkdestlen(buflen, 9);
-            double v = lua_tonumber(L, -1);
-            B[0] = SIGN_FLT;
-            B[1] = *(char*)&v;
-            B[2] = *((char*)&v + 1);
-            B[3] = *((char*)&v + 2);
-            B[4] = *((char*)&v + 3);
-            B[5] = *((char*)&v + 4);
-            B[6] = *((char*)&v + 5);
-            B[7] = *((char*)&v + 6);
-            B[8] = *((char*)&v + 7);
-            return 9;
+        if (get32(F + i * 4, S->swap) >= tlen) {
+            scanfail(E, S, F + i * 4, LOS_ESIGN);
         }
     }
-    case LUA_TSTRING: {
-        size_t len;
-        const char* s = lua_tolstring(L, -1, &len);
-        if (len <= 31) {
-            checkdestlen(buflen, 1 + len);
-            uint8_t c = (uint8_t)len;
-            c |= SIGN_SHRSTR;
-            B[0] = c;
-            memcpy(B + 1, s, len);
-            return 1 + len;
-        }
-        else if (len <= UINT8_MAX) {
-            checkdestlen(buflen, 2 + len);
-            uint8_t c = (uint8_t)len;
-            B[0] = SIGN_STR1;
-            B[1] = c;
-            memcpy(B + 2, s, len);
-            return 2 + len;
+    return total + (size_t)len;
+}
+
+
+static size_t scanref(jmp_buf E, const char* B, size_t buflen, int on, uint64_t n)
+{
+    uint64_t ref;
+    size_t len = 1 + getvarint(E, B + 1, buflen - 1, &ref);
+    if (!on || ref >= n) {
+        los_throw(E, LOS_ESIGN);
+    }
+    return len;
+}
+
+
+/*
+** Checks one item at B, returning its length, or 0 at the end of a table
+** part like decode.
+*/
+static size_t scannext(jmp_buf E, losscan* S, const char* B, size_t buflen)
+{
+    S->at = B;
+    checksrclen(buflen, 1);
+    uint8_t c = (uint8_t)B[0];
+    switch (c)
+    {
+    case SIGN_TBLBEG: {
+        return scantable(E, S, B, buflen);
+    }
+    case SIGN_TBLSEP:
+    case SIGN_TBLEND: {
+        return 0;
+    }
+    case SIGN_TBLSIZ:
+    case SIGN_HDR: {
+        los_throw(E, LOS_ESIGN);
+    }
+    case SIGN_SHAPE:
+    case SIGN_SHPDEF: {
+        return scanshape(E, S, B, buflen);
+    }
+    }
+    size_t n = itemlen(E, B, buflen, S->swap);
+    if (n == 0 || n > buflen) {
+        los_throw(E, LOS_ESRC);
+    }
+    if (!S->deep) {
+        if (c == SIGN_INDEX && (S->flags & FLAG_SHAPE)) {
+            return scanindex(E, S, B, buflen);
         }
-        else if (len <= UINT16_MAX) {
-            checkdestlen(buflen, 3 + len);
-            uint16_t i = (uint16_t)len;
-            B[0] = SIGN_STR2;
-            B[1] = *(char*)&i;
-            B[2] = *((char*)&i + 1);
-            memcpy(B + 3, s, len);
-            return 3 + len;
+        return n;
+    }
+    if (isstrsign(c) && c != SIGN_STRREF && (S->flags & FLAG_STRREF)) {
+        const char* s;
+        size_t len;
+        viewstr(E, B, n, S->swap, &s, &len);
+        S->nstr += len >= STRREF_MIN;
+    }
+    switch (c)
+    {
+    case SIGN_STRREF: {
+        return scanref(E, B, buflen, S->flags & FLAG_STRREF, S->nstr);
+    }
+    case SIGN_TBLREF: {
+        return scanref(E, B, buflen, S->flags & FLAG_TBLREF, S->ntbl);
+    }
+    case SIGN_COLUMNS: {
+        return scancolumns(E, S, B, buflen);
+    }
+    case SIGN_INDEX: {
+        return scanindex(E, S, B, buflen);
+    }
+    case SIGN_ARRAY: {
+        uint64_t narr;
+        getvarint(E, B + 2, buflen - 2, &narr);
+        if (narr > INT_MAX) {
+            los_throw(E, LOS_ESIGN);
         }
-        else if (len <= UINT32_MAX) {
-            checkdestlen(buflen, 5 + len);
-            uint32_t i = (uint32_t)len;
-            B[0] = SIGN_STR4;
-            B[1] = *(char*)&i;
-            B[2] = *((char*)&i + 1);
-            B[3] = *((char*)&i + 2);
-            B[4] = *((char*)&i + 3);
-            memcpy(B + 5, s, len);
-            return 5 + len;
+        ++S->ntbl;
+        return n;
+    }
+    }
+    return n;
+}
+
+
+/*
+** Walks the frames of a compressed object. When validating, the blocks
+** are inflated into one buffer, noting where each frame ends in it, and
+** the object is checked as a whole.
+*/
+static size_t scanlz(jmp_buf E, losscan* S, const char* B, size_t buflen)
+{
+    size_t pos = 0;
+    for (;;) {
+        S->at = B + pos;
+        size_t rawlen;
+        size_t complen;
+        size_t n = lzframelen(E, B + pos, buflen - pos, &rawlen, &complen);
+        if (n == 0 || n > buflen - pos) {
+            los_throw(E, LOS_ESRC);
         }
-        else {
-            los_throw(E, LOS_ESTR);
+        if (rawlen == 0) {
+            pos += n;
+            break;
         }
-        return 0;
-    }
-    case LUA_TTABLE: {
-        checkdestlen(buflen, 1);
-        B[0] = SIGN_TBLBEG;
-        size_t size = 1;
-        size_t len = lua_rawlen(L, -1);
-        size_t numnil = 0;
-        for (size_t i = 1; i <= len; ++i) {
-            if (lua_rawgeti(L, -1, i) == LUA_TNIL) {
-                ++numnil;
+        if (S->deep) {
+            const char* data = B + pos + n - (complen ? complen : rawlen);
+            char* p = losbuf_prep(&S->raw, rawlen);
+            if (complen) {
+                lzinflate(E, data, complen, p, rawlen);
             }
             else {
-                checkdestlen(buflen, size + numnil);
-                for (size_t j = 0; j < numnil; ++j) {
-                    B[size + j] = SIGN_NIL;
-                }
-                size += numnil;
-                numnil = 0;
-                size += dumpbuf(E, L, B + size, buflen - size);
+                memcpy(p, data, rawlen);
             }
-            lua_pop(L, 1);
-        }
-        checkdestlen(buflen, size + 1);
-        B[size] = SIGN_TBLSEP;
-        ++size;
-        int top = lua_gettop(L);
-        if (len > 0) {
-            size_t lastkey = len - numnil;
-            lua_pushinteger(L, lastkey);
+            S->raw.n += rawlen;
+            size_t ends[2] = {S->raw.n, pos};
+            losbuf_addlstring(&S->frames, (const char*)ends, sizeof(ends));
         }
-        else {
-            lua_pushnil(L);
+        pos += n;
+    }
+    if (S->deep) {
+        S->lz = B;
+        size_t n = scannext(E, S, S->raw.b, S->raw.n);
+        if (n != S->raw.n) {
+            scanfail(E, S, S->raw.b + n, LOS_ESIGN);
         }
-        while (lua_next(L, -2)) {
-            size += dumpbuf(E, L, B + size, buflen - size);
-            lua_pop(L, 1);
-            size += dumpbuf(E, L, B + size, buflen - size);
+        S->lz = NULL;
+    }
+    return pos;
+}
+
+
+static size_t scanobject(jmp_buf E, losscan* S, const char* B, size_t size)
+{
+    S->at = B;
+    size_t pos = readhdr(E, B, size, &S->flags);
+    if (S->flags & FLAG_LZ) {
+        S->flags &= ~FLAG_LZ;
+        return pos + scanlz(E, S, B + pos, size - pos);
+    }
+    size_t n = scannext(E, S, B + pos, size - pos);
+    if (n == 0) {
+        los_throw(E, LOS_ESIGN);
+    }
+    return pos + n;
+}
+
+
+/*
+** Offset of the item at fault. Inside the blocks of a compressed object
+** it is the offset of the frame holding it.
+*/
+static size_t scanoffset(losscan* S, const char* B)
+{
+    if (S->lz == NULL) {
+        return (size_t)(S->at - B);
+    }
+    size_t off = (size_t)(S->at - S->raw.b);
+    size_t ends[2] = {0, 0};
+    for (size_t i = 0; i < S->frames.n; i += sizeof(ends)) {
+        memcpy(ends, S->frames.b + i, sizeof(ends));
+        if (off < ends[0]) {
+            break;
         }
-        lua_settop(L, top);
-        checkdestlen(buflen, size + 1);
-        B[size] = SIGN_TBLEND;
-        ++size;
-        return size;
     }
-    default: {
-        los_throw(E, LOS_ETYPE);
+    return (size_t)(S->lz - B) + ends[1];
+}
+
+
+static int scanvalue(lua_State* L, int swap, int deep)
+{
+    luaL_checkany(L, 1);
+    const char* B;
+    size_t size;
+    if (lua_islightuserdata(L, 1)) {
+        B = lua_touserdata(L, 1);
+        size = luaL_checkinteger(L, 2);
+    }
+    else {
+        luaL_argexpected(L, lua_isstring(L, 1), 1, lua_typename(L, LUA_TSTRING));
+        B = lua_tolstring(L, 1, &size);
     }
+    lua_settop(L, 2);
+    losscan S;
+    S.at = B;
+    S.swap = swap;
+    S.flags = 0;
+    S.deep = deep;
+    S.depth = 0;
+    S.nstr = 0;
+    S.ntbl = 0;
+    S.lz = NULL;
+    losbuf_init(L, &S.shapes);
+    losbuf_init(L, &S.raw);
+    losbuf_init(L, &S.frames);
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        lua_pushinteger(L, err);
+        lua_pushinteger(L, scanoffset(&S, B));
+        return 2;
     }
-    return 0;
+    lua_pushinteger(L, scanobject(E, &S, B, size));
+    return 1;
 }
 
 
-static size_t dumpbuf_x(jmp_buf E, lua_State* L, char* B, size_t buflen)
+static int los_validate(lua_State* L)
 {
-    int type = lua_type(L, -1);
-    switch (type)
+    return scanvalue(L, 0, 1);
+}
+
+
+static int los_validate_x(lua_State* L)
+{
+    return scanvalue(L, 1, 1);
+}
+
+
+static int los_length(lua_State* L)
+{
+    return scanvalue(L, 0, 0);
+}
+
+
+static int los_length_x(lua_State* L)
+{
+    return scanvalue(L, 1, 0);
+}
+
+
+/*
+** Value trees. los_parse decodes the binary format into a tree of nodes
+** in C memory without a lua_State, so it can run on any thread, and
+** los_pushtree builds the Lua value from the tree on the thread owning the
+** state, which is then little more than creating the tables. The nodes
+** live in an arena of malloc'd blocks freed at once by los_freetree.
+** Strings aren't copied: a string node is a slice of the source, which
+** must outlive the tree, or of the inflated content of a compressed
+** object, which the tree owns. Packed arrays stay packed until pushed.
+** Tables are numbered as load numbers them, and a table reference is a
+** node holding that number, resolved by los_pushtree through the tables
+** pushed so far. Nesting is capped as in the scanner.
+*/
+#define NODE_NIL   0
+#define NODE_FALSE 1
+#define NODE_TRUE  2
+#define NODE_INT   3
+#define NODE_FLT   4
+#define NODE_STR   5
+#define NODE_TBL   6
+#define NODE_ARR   7
+#define NODE_REF   8
+
+#define TREE_BLOCK 65536
+
+typedef struct losnode losnode;
+
+struct losnode
+{
+    int type;
+    union
     {
-    case LUA_TNIL: {
-        checkdestlen(buflen, 1);
-        B[0] = SIGN_NIL;
-        return 1;
+        lua_Integer i;
+        double d;
+        size_t ref;
+        struct { const char* s; size_t len; } str;
+        struct { losnode* items; size_t narr; size_t nrec; size_t id; } tbl;
+        struct { const char* p; size_t n; int type; size_t id; } arr;
+    } u;
+};
+
+typedef struct losblock
+{
+    struct losblock* next;
+    size_t size;
+    size_t n;
+} losblock;
+
+typedef struct losshape
+{
+    losnode* keys;
+    size_t n;
+} losshape;
+
+typedef struct lostree
+{
+    losblock* blocks;
+    losnode root;
+    size_t len;
+    int    swap;
+    int    flags;
+    int    depth;
+    size_t ntbl;
+    losnode* stack;
+    size_t nstack;
+    size_t maxstack;
+    losnode* strs;
+    size_t nstr;
+    size_t maxstr;
+    losshape* shapes;
+    size_t nshape;
+    size_t maxshape;
+} lostree;
+
+
+static void* treealloc(jmp_buf E, lostree* T, size_t size)
+{
+    if (size == 0) {
+        return NULL;
     }
-    case LUA_TBOOLEAN: {
-        checkdestlen(buflen, 1);
-        B[0] = lua_toboolean(L, -1) ? SIGN_TRUE : SIGN_FALSE;
-        return 1;
+    size = (size + 7) & ~(size_t)7;
+    losblock* b = T->blocks;
+    if (b == NULL || b->size - b->n < size) {
+        size_t bsize = size > TREE_BLOCK ? size : TREE_BLOCK;
+        b = malloc(sizeof(losblock) + bsize);
+        if (b == NULL) {
+            los_throw(E, LOS_EMEM);
+        }
+        b->next = T->blocks;
+        b->size = bsize;
+        b->n = 0;
+        T->blocks = b;
     }
-    case LUA_TNUMBER: {
-        if (lua_isinteger(L, -1)) {
-            int64_t v = lua_tointeger(L, -1);
-            if (-63 <= v && v <= 127) {
-                checkdestlen(buflen, 1);
-                int8_t i = (int8_t)v;
-                B[0] = i;
-                return 1;
-            }
-            else if (INT8_MIN <= v && v <= INT8_MAX) {
-                checkdestlen(buflen, 2);
-                int8_t i = (int8_t)v;
-                B[0] = SIGN_INT1;
-                B[1] = i;
-                return 2;
-            }
-            else if (INT16_MIN <= v && v <= INT16_MAX) {
-                checkdestlen(buflen, 3);
-                int16_t i = (int16_t)v;
-                B[0] = SIGN_INT2;
-                B[1] = *((char*)&i + 1);
-                B[2] = *(char*)&i;
-                return 3;
-            }
-            else if (INT32_MIN <= v && v <= INT32_MAX) {
-                checkdestlen(buflen, 5);
-                int32_t i = (int32_t)v;
-                B[0] = SIGN_INT4;
-                B[1] = *((char*)&i + 3);
-                B[2] = *((char*)&i + 2);
-                B[3] = *((char*)&i + 1);
-                B[4] = *(char*)&i;
-                return 5;
-            }
-            else {
-                checkdestlen(buflen, 9);
-                B[0] = SIGN_INT8;
-                B[1] = *((char*)&v + 7);
-                B[2] = *((char*)&v + 6);
-                B[3] = *((char*)&v + 5);
-                B[4] = *((char*)&v + 4);
-                B[5] = *((char*)&v + 3);
-                B[6] = *((char*)&v + 2);
-                B[7] = *((char*)&v + 1);
-                B[8] = *(char*)&v;
-                return 9;
+    void* p = (char*)(b + 1) + b->n;
+    b->n += size;
+    return p;
+}
+
+
+/*
+** Makes room for one more element of a scratch vector.
+*/
+static void* treegrow(jmp_buf E, void* v, size_t n, size_t* max, size_t elem)
+{
+    if (n < *max) {
+        return v;
+    }
+    size_t newmax = *max ? *max * 2 : 64;
+    if (newmax > SIZE_MAX / elem) {
+        los_throw(E, LOS_EMEM);
+    }
+    void* p = realloc(v, newmax * elem);
+    if (p == NULL) {
+        los_throw(E, LOS_EMEM);
+    }
+    *max = newmax;
+    return p;
+}
+
+
+/*
+** The parser keeps the nodes of the tables being parsed on a stack and
+** moves them into the arena when a table ends.
+*/
+static losnode* treepush(jmp_buf E, lostree* T, int type)
+{
+    T->stack = treegrow(E, T->stack, T->nstack, &T->maxstack, sizeof(losnode));
+    losnode* N = &T->stack[T->nstack++];
+    N->type = type;
+    return N;
+}
+
+
+static void treestr(jmp_buf E, lostree* T, const char* s, size_t len)
+{
+    losnode* N = treepush(E, T, NODE_STR);
+    N->u.str.s = s;
+    N->u.str.len = len;
+    if ((T->flags & FLAG_STRREF) && len >= STRREF_MIN) {
+        T->strs = treegrow(E, T->strs, T->nstr, &T->maxstr, sizeof(losnode));
+        T->strs[T->nstr++] = *N;
+    }
+}
+
+
+static size_t treetableid(lostree* T)
+{
+    ++T->ntbl;
+    return (T->flags & FLAG_TBLREF) ? T->ntbl : 0;
+}
+
+
+/*
+** Moves the nodes above base into the arena as the items of a table.
+*/
+static void treetable(jmp_buf E, lostree* T, size_t base, size_t narr, size_t id)
+{
+    size_t n = T->nstack - base;
+    losnode* items = treealloc(E, T, n * sizeof(losnode));
+    if (n > 0) {
+        memcpy(items, T->stack + base, n * sizeof(losnode));
+    }
+    T->nstack = base;
+    losnode* N = treepush(E, T, NODE_TBL);
+    N->u.tbl.items = items;
+    N->u.tbl.narr = narr;
+    N->u.tbl.nrec = (n - narr) / 2;
+    N->u.tbl.id = id;
+}
+
+
+static size_t treenext(jmp_buf E, lostree* T, const char* B, size_t buflen);
+
+
+static size_t treevalue(jmp_buf E, lostree* T, const char* B, size_t buflen)
+{
+    size_t n = treenext(E, T, B, buflen);
+    if (n == 0) {
+        los_throw(E, LOS_ESIGN);
+    }
+    return n;
+}
+
+
+static void treekey(jmp_buf E, const losnode* N)
+{
+    if (N->type == NODE_NIL || (N->type == NODE_FLT && N->u.d != N->u.d)) {
+        los_throw(E, LOS_ESIGN);
+    }
+}
+
+
+static size_t treeplain(jmp_buf E, lostree* T, const char* B, size_t buflen)
+{
+    if (++T->depth > SCAN_MAXDEPTH) {
+        los_throw(E, LOS_ESIGN);
+    }
+    size_t total = 1;
+    if (buflen > 1 && (uint8_t)B[1] == SIGN_TBLSIZ) {
+        ++total;
+        for (int i = 0; i < 2; ++i) {
+            total += treevalue(E, T, B + total, buflen - total);
+            losnode* N = &T->stack[--T->nstack];
+            if (N->type != NODE_INT || N->u.i < 0) {
+                los_throw(E, LOS_ESIGN);
             }
         }
-        else {
-            checkdestlen(buflen, 9);
-            double v = lua_tonumber(L, -1);
-            B[0] = SIGN_FLT;
-            B[1] = *((char*)&v + 7);
-            B[2] = *((char*)&v + 6);
-            B[3] = *((char*)&v + 5);
-            B[4] = *((char*)&v + 4);
-            B[5] = *((char*)&v + 3);
-            B[6] = *((char*)&v + 2);
-            B[7] = *((char*)&v + 1);
-            B[8] = *(char*)&v;
-            return 9;
+    }
+    size_t id = treetableid(T);
+    size_t base = T->nstack;
+    size_t consume;
+    while (consume = treenext(E, T, B + total, buflen - total)) {
+        total += consume;
+    }
+    if ((uint8_t)B[total] != SIGN_TBLSEP) {
+        los_throw(E, LOS_ESIGN);
+    }
+    size_t narr = T->nstack - base;
+    ++total;
+    while (consume = treenext(E, T, B + total, buflen - total)) {
+        total += consume;
+        consume = treenext(E, T, B + total, buflen - total);
+        if (consume == 0) {
+            los_throw(E, LOS_ESRC);
         }
+        total += consume;
+        losnode* kv = &T->stack[T->nstack - 2];
+        losnode v = kv[0];
+        kv[0] = kv[1];
+        kv[1] = v;
+        treekey(E, &kv[0]);
     }
-    case LUA_TSTRING: {
-        size_t len;
-        const char* s = lua_tolstring(L, -1, &len);
-        if (len <= 31) {
-            checkdestlen(buflen, 1 + len);
-            uint8_t c = (uint8_t)len;
-            c |= SIGN_SHRSTR;
-            B[0] = c;
-            memcpy(B + 1, s, len);
-            return 1 + len;
+    if ((uint8_t)B[total] != SIGN_TBLEND) {
+        los_throw(E, LOS_ESIGN);
+    }
+    treetable(E, T, base, narr, id);
+    --T->depth;
+    return total + 1;
+}
+
+
+static size_t treeshape(jmp_buf E, lostree* T, const char* B, size_t buflen)
+{
+    if (!(T->flags & FLAG_SHAPE)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t v;
+    size_t total = 1 + getvarint(E, B + 1, buflen - 1, &v);
+    if ((uint8_t)B[0] == SIGN_SHPDEF) {
+        if (v == 0) {
+            los_throw(E, LOS_ESIGN);
         }
-        else if (len <= UINT8_MAX) {
-            checkdestlen(buflen, 2 + len);
-            uint8_t c = (uint8_t)len;
-            B[0] = SIGN_STR1;
-            B[1] = c;
-            memcpy(B + 2, s, len);
-            return 2 + len;
+        if (v > (buflen - total) / 2) {
+            los_throw(E, LOS_ESRC);
         }
-        else if (len <= UINT16_MAX) {
-            checkdestlen(buflen, 3 + len);
-            uint16_t i = (uint16_t)len;
-            B[0] = SIGN_STR2;
-            B[1] = *((char*)&i + 1);
-            B[2] = *(char*)&i;
-            memcpy(B + 3, s, len);
-            return 3 + len;
+        size_t base = T->nstack;
+        for (uint64_t i = 0; i < v; ++i) {
+            total += treevalue(E, T, B + total, buflen - total);
+            if (T->stack[T->nstack - 1].type != NODE_STR) {
+                los_throw(E, LOS_ESIGN);
+            }
         }
-        else if (len <= UINT32_MAX) {
-            checkdestlen(buflen, 5 + len);
-            uint32_t i = (uint32_t)len;
-            B[0] = SIGN_STR4;
-            B[1] = *((char*)&i + 3);
-            B[2] = *((char*)&i + 2);
-            B[3] = *((char*)&i + 1);
-            B[4] = *(char*)&i;
-            memcpy(B + 5, s, len);
-            return 5 + len;
+        T->shapes = treegrow(E, T->shapes, T->nshape, &T->maxshape, sizeof(losshape));
+        losshape* S = &T->shapes[T->nshape++];
+        S->n = (size_t)v;
+        S->keys = treealloc(E, T, S->n * sizeof(losnode));
+        memcpy(S->keys, T->stack + base, S->n * sizeof(losnode));
+        T->nstack = base;
+    }
+    else if (v >= T->nshape) {
+        los_throw(E, LOS_ESIGN);
+    }
+    size_t shape = (uint8_t)B[0] == SIGN_SHPDEF ? T->nshape - 1 : (size_t)v;
+    if (++T->depth > SCAN_MAXDEPTH) {
+        los_throw(E, LOS_ESIGN);
+    }
+    size_t id = treetableid(T);
+    size_t base = T->nstack;
+    size_t n = T->shapes[shape].n;
+    for (size_t i = 0; i < n; ++i) {
+        *treepush(E, T, NODE_NIL) = T->shapes[shape].keys[i];
+        total += treevalue(E, T, B + total, buflen - total);
+    }
+    treetable(E, T, base, 0, id);
+    --T->depth;
+    return total;
+}
+
+
+static size_t treecolstr(jmp_buf E, const char* B, size_t buflen, losnode* N)
+{
+    uint64_t len;
+    size_t n = getvarint(E, B, buflen, &len);
+    checksrclen(buflen - n, len);
+    N->type = NODE_STR;
+    N->u.str.s = B + n;
+    N->u.str.len = (size_t)len;
+    return n + len;
+}
+
+
+/*
+** Cell i of the column with key k in the rows of a columnar block.
+*/
+#define treecell(rows, i, k) (&(rows)[i].u.tbl.items[2 * (k) + 1])
+
+static size_t treecolumn(jmp_buf E, lostree* T, const char* B, size_t buflen,
+                         losnode* rows, size_t nrows, size_t k)
+{
+    checksrclen(buflen, 1);
+    size_t pos = 1;
+    switch (B[0])
+    {
+    case COL_INT: {
+        uint64_t v = 0;
+        for (size_t i = 0; i < nrows; ++i) {
+            uint64_t z;
+            pos += getvarint(E, B + pos, buflen - pos, &z);
+            v += unzigzag(z);
+            losnode* N = treecell(rows, i, k);
+            N->type = NODE_INT;
+            N->u.i = (lua_Integer)v;
         }
-        else {
-            los_throw(E, LOS_ESTR);
+        break;
+    }
+    case COL_FLT: {
+        checksrclen((buflen - pos) / 8, nrows);
+        for (size_t i = 0; i < nrows; ++i) {
+            uint64_t u = get64(B + pos, T->swap);
+            losnode* N = treecell(rows, i, k);
+            N->type = NODE_FLT;
+            memcpy(&N->u.d, &u, 8);
+            pos += 8;
         }
-        return 0;
+        break;
+    }
+    case COL_BOOL: {
+        size_t nbytes = (nrows + 7) / 8;
+        checksrclen(buflen - pos, nbytes);
+        for (size_t i = 0; i < nrows; ++i) {
+            int b = ((uint8_t)B[pos + i / 8] >> (i % 8)) & 1;
+            treecell(rows, i, k)->type = b ? NODE_TRUE : NODE_FALSE;
+        }
+        pos += nbytes;
+        break;
+    }
+    case COL_STR: {
+        for (size_t i = 0; i < nrows; ++i) {
+            pos += treecolstr(E, B + pos, buflen - pos, treecell(rows, i, k));
+        }
+        break;
     }
-    case LUA_TTABLE: {
-        checkdestlen(buflen, 1);
-        B[0] = SIGN_TBLBEG;
-        size_t size = 1;
-        size_t len = lua_rawlen(L, -1);
-        size_t numnil = 0;
-        for (size_t i = 1; i <= len; ++i) {
-            if (lua_rawgeti(L, -1, i) == LUA_TNIL) {
-                ++numnil;
-            }
-            else {
-                checkdestlen(buflen, size + numnil);
-                for (size_t j = 0; j < numnil; ++j) {
-                    B[size + j] = SIGN_NIL;
-                }
-                size += numnil;
-                numnil = 0;
-                size += dumpbuf_x(E, L, B + size, buflen - size);
-            }
-            lua_pop(L, 1);
+    case COL_DICT: {
+        uint64_t ndict;
+        pos += getvarint(E, B + pos, buflen - pos, &ndict);
+        if (ndict > buflen - pos) {
+            los_throw(E, LOS_ESRC);
         }
-        checkdestlen(buflen, size + 1);
-        B[size] = SIGN_TBLSEP;
-        ++size;
-        int top = lua_gettop(L);
-        if (len > 0) {
-            size_t lastkey = len - numnil;
-            lua_pushinteger(L, lastkey);
+        losnode* dict = treealloc(E, T, (size_t)ndict * sizeof(losnode));
+        for (uint64_t j = 0; j < ndict; ++j) {
+            pos += treecolstr(E, B + pos, buflen - pos, &dict[j]);
         }
-        else {
-            lua_pushnil(L);
+        for (size_t i = 0; i < nrows; ++i) {
+            uint64_t idx;
+            pos += getvarint(E, B + pos, buflen - pos, &idx);
+            if (idx >= ndict) {
+                los_throw(E, LOS_ESIGN);
+            }
+            *treecell(rows, i, k) = dict[idx];
         }
-        while (lua_next(L, -2)) {
-            size += dumpbuf_x(E, L, B + size, buflen - size);
-            lua_pop(L, 1);
-            size += dumpbuf_x(E, L, B + size, buflen - size);
+        break;
+    }
+    case COL_ANY: {
+        for (size_t i = 0; i < nrows; ++i) {
+            pos += treevalue(E, T, B + pos, buflen - pos);
+            *treecell(rows, i, k) = T->stack[--T->nstack];
         }
-        lua_settop(L, top);
-        checkdestlen(buflen, size + 1);
-        B[size] = SIGN_TBLEND;
-        ++size;
-        return size;
+        break;
     }
     default: {
-        los_throw(E, LOS_ETYPE);
+        los_throw(E, LOS_ESIGN);
     }
     }
-    return 0;
+    return pos;
+}
+
+
+/*
+** A columnar block becomes its rows, which load doesn't number.
+*/
+static size_t treecolumns(jmp_buf E, lostree* T, const char* B, size_t buflen)
+{
+    if (!(T->flags & FLAG_COLUMN)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t len;
+    size_t total = 1 + getvarint(E, B + 1, buflen - 1, &len);
+    checksrclen(buflen - total, len);
+    B += total;
+    uint64_t nrows;
+    uint64_t nkeys;
+    size_t pos = getvarint(E, B, len, &nrows);
+    pos += getvarint(E, B + pos, len - pos, &nkeys);
+    if (!colsfit(nrows, nkeys, len - pos)) {
+        los_throw(E, LOS_ESIGN);
+    }
+    if (++T->depth > SCAN_MAXDEPTH) {
+        los_throw(E, LOS_ESIGN);
+    }
+    losnode* rows = treealloc(E, T, (size_t)nrows * sizeof(losnode));
+    for (size_t i = 0; i < nrows; ++i) {
+        rows[i].type = NODE_TBL;
+        rows[i].u.tbl.items = treealloc(E, T, (size_t)nkeys * 2 * sizeof(losnode));
+        rows[i].u.tbl.narr = 0;
+        rows[i].u.tbl.nrec = (size_t)nkeys;
+        rows[i].u.tbl.id = 0;
+    }
+    int flags = T->flags;
+    T->flags = FLAG_COLUMN | FLAG_VARINT;
+    for (size_t k = 0; k < nkeys; ++k) {
+        pos += treevalue(E, T, B + pos, len - pos);
+        losnode key = T->stack[--T->nstack];
+        if (key.type != NODE_STR) {
+            los_throw(E, LOS_ESIGN);
+        }
+        for (size_t i = 0; i < nrows; ++i) {
+            rows[i].u.tbl.items[2 * k] = key;
+        }
+        pos += treecolumn(E, T, B + pos, len - pos, rows, (size_t)nrows, k);
+    }
+    if (pos != len) {
+        los_throw(E, LOS_ESIGN);
+    }
+    T->flags = flags;
+    --T->depth;
+    losnode* N = treepush(E, T, NODE_TBL);
+    N->u.tbl.items = rows;
+    N->u.tbl.narr = (size_t)nrows;
+    N->u.tbl.nrec = 0;
+    N->u.tbl.id = 0;
+    return total + len;
+}
+
+
+static size_t treearray(jmp_buf E, lostree* T, const char* B, size_t buflen)
+{
+    checksrclen(buflen, 2);
+    int type = (uint8_t)B[1];
+    if (type < ARR_F64 || type > ARR_BOOL) {
+        los_throw(E, LOS_ESIGN);
+    }
+    uint64_t narr;
+    size_t total = 2 + getvarint(E, B + 2, buflen - 2, &narr);
+    if (narr > (buflen - total) * 8 || arraylen(narr, type) > buflen - total) {
+        los_throw(E, LOS_ESRC);
+    }
+    if (narr > INT_MAX) {
+        los_throw(E, LOS_ESIGN);
+    }
+    losnode* N = treepush(E, T, NODE_ARR);
+    N->u.arr.p = B + total;
+    N->u.arr.n = (size_t)narr;
+    N->u.arr.type = type;
+    N->u.arr.id = treetableid(T);
+    return total + arraylen(narr, type);
+}
+
+
+static size_t treeref(jmp_buf E, lostree* T, const char* B, size_t buflen)
+{
+    uint64_t ref;
+    size_t len = 1 + getvarint(E, B + 1, buflen - 1, &ref);
+    if ((uint8_t)B[0] == SIGN_STRREF) {
+        if (!(T->flags & FLAG_STRREF) || ref >= T->nstr) {
+            los_throw(E, LOS_ESIGN);
+        }
+        *treepush(E, T, NODE_STR) = T->strs[ref];
+    }
+    else {
+        if (!(T->flags & FLAG_TBLREF) || ref >= T->ntbl) {
+            los_throw(E, LOS_ESIGN);
+        }
+        treepush(E, T, NODE_REF)->u.ref = (size_t)ref + 1;
+    }
+    return len;
 }
 
 
-static size_t load(jmp_buf E, lua_State* L, const char* B, size_t buflen)
+/*
+** Parses one value at B onto the node stack, returning its length, or 0
+** at the end of a table part like decode.
+*/
+static size_t treenext(jmp_buf E, lostree* T, const char* B, size_t buflen)
 {
     if (buflen == 0) {
         los_throw(E, LOS_ESRC);
     }
-    char c = B[0];
+    uint8_t c = (uint8_t)B[0];
     if (IS_SHRINT(c)) {
-        lua_pushinteger(L, c);
+        treepush(E, T, NODE_INT)->u.i = (int8_t)c;
         return 1;
     }
     if (IS_SHRSTR(c)) {
-        c &= ~MASK_SHRSTR;
-        size_t len = c;
+        size_t len = c & ~MASK_SHRSTR;
         checksrclen(buflen, 1 + len);
-        lua_pushlstring(L, B + 1, len);
+        treestr(E, T, B + 1, len);
         return 1 + len;
     }
-    int sign = (uint8_t)c;
-    switch (sign)
+    switch (c)
     {
-    case SIGN_NIL: {
-        lua_pushnil(L);
-        return 1;
-    }
-    case SIGN_FALSE: {
-        lua_pushboolean(L, 0);
-        return 1;
-    }
+    case SIGN_NIL:
+    case SIGN_FALSE:
     case SIGN_TRUE: {
-        lua_pushboolean(L, 1);
+        treepush(E, T, c == SIGN_NIL ? NODE_NIL : c == SIGN_FALSE ? NODE_FALSE : NODE_TRUE);
         return 1;
     }
-    case SIGN_INT1: {
-        checksrclen(buflen, 2);
-        lua_pushinteger(L, B[1]);
-        return 2;
-    }
-    case SIGN_INT2: {
-        checksrclen(buflen, 3);
-        ucast u = (ucast){
-            .i8[0] = B[1],
-            .i8[1] = B[2],
-        };
-        lua_pushinteger(L, u.i16[0]);
-        return 3;
+    case SIGN_INT1:
+    case SIGN_INT2:
+    case SIGN_INT4:
+    case SIGN_INT8:
+    case SIGN_VINT: {
+        int64_t v;
+        size_t n = readint(E, B, buflen, T->swap, &v);
+        treepush(E, T, NODE_INT)->u.i = (lua_Integer)v;
+        return n;
     }
-    case SIGN_INT4: {
-        checksrclen(buflen, 5);
-        ucast u = (ucast){
-            .i8[0] = B[1],
-            .i8[1] = B[2],
-            .i8[2] = B[3],
-            .i8[3] = B[4],
-        };
-        lua_pushinteger(L, u.i32[0]);
-        return 5;
-    } 
-    case SIGN_INT8: {
+    case SIGN_FLT: {
         checksrclen(buflen, 9);
-        ucast u = (ucast){
-            .i8[0] = B[1],
-            .i8[1] = B[2],
-            .i8[2] = B[3],
-            .i8[3] = B[4],
-            .i8[4] = B[5],
-            .i8[5] = B[6],
-            .i8[6] = B[7],
-            .i8[7] = B[8],
-        };
-        lua_pushinteger(L, u.i64);
+        uint64_t u = get64(B + 1, T->swap);
+        memcpy(&treepush(E, T, NODE_FLT)->u.d, &u, 8);
         return 9;
     }
-    case SIGN_STR1: {
-        checksrclen(buflen, 2);
-        size_t len = B[1];
-        checksrclen(buflen, 2 + len);
-        lua_pushlstring(L, B + 2, len);
-        return 2 + len;
+    case SIGN_STR1:
+    case SIGN_STR2:
+    case SIGN_STR4:
+    case SIGN_VSTR: {
+        size_t n = itemlen(E, B, buflen, T->swap);
+        if (n == 0 || n > buflen) {
+            los_throw(E, LOS_ESRC);
+        }
+        const char* s;
+        size_t len;
+        viewstr(E, B, n, T->swap, &s, &len);
+        treestr(E, T, s, len);
+        return n;
     }
-    case SIGN_STR2: {
-        checksrclen(buflen, 3);
-        ucast u = (ucast){
-            .u8[0] = B[1],
-            .u8[1] = B[2],
-        };
-        size_t len = u.u16[0];
-        checksrclen(buflen, 3 + len);
-        lua_pushlstring(L, B, 3 + len);
-        return 3 + len;
+    case SIGN_TBLBEG: {
+        return treeplain(E, T, B, buflen);
     }
-    case SIGN_STR4: {
-        checksrclen(buflen, 5);
-        ucast u = (ucast){
-            .u8[0] = B[1],
-            .u8[1] = B[2],
-            .u8[2] = B[3],
-            .u8[3] = B[4],
-        };
-        size_t len = u.u32[0];
-        checksrclen(buflen, 5 + len);
-        lua_pushlstring(L, B + 5, len);
-        return 5 + len;
+    case SIGN_STRREF:
+    case SIGN_TBLREF: {
+        return treeref(E, T, B, buflen);
     }
-    case SIGN_FLT: {
-        checksrclen(buflen, 9);
-        ucast u = (ucast){
-            .u8[0] = B[1],
-            .u8[1] = B[2],
-            .u8[2] = B[3],
-            .u8[3] = B[4],
-            .u8[4] = B[5],
-            .u8[5] = B[6],
-            .u8[6] = B[7],
-            .u8[7] = B[8],
-        };
-        lua_pushnumber(L, u.f);
-        return 9;
+    case SIGN_SHAPE:
+    case SIGN_SHPDEF: {
+        return treeshape(E, T, B, buflen);
     }
-    case SIGN_TBLBEG: {
-        size_t total = 1;
-        size_t consume = 0;
-        lua_newtable(L);
-        int i = 1;
-        while (consume = load(E, L, B + total, buflen - total)) {
-            lua_rawseti(L, -2, i++);
-            total += consume;
+    case SIGN_COLUMNS: {
+        return treecolumns(E, T, B, buflen);
+    }
+    case SIGN_ARRAY: {
+        return treearray(E, T, B, buflen);
+    }
+    case SIGN_INDEX: {
+        if (!(T->flags & FLAG_INDEX)) {
+            los_throw(E, LOS_ESIGN);
         }
-        ++total;
-        while (consume = load(E, L, B + total, buflen - total)) {
-            total += consume;
-            consume = load(E, L, B + total, buflen - total);
-            if (consume == 0) {
-                los_throw(E, LOS_ESRC);
-            }
-            total += consume;
-            lua_rotate(L, -2, 1);
-            lua_rawset(L, -3);
+        uint64_t len;
+        size_t n = 1 + getvarint(E, B + 1, buflen - 1, &len);
+        checksrclen(buflen - n, len);
+        if (len == 0 || (uint8_t)B[n] != SIGN_TBLBEG) {
+            los_throw(E, LOS_ESIGN);
         }
-        ++total;
-        return total;
+        treeplain(E, T, B + n, (size_t)len);
+        return n + (size_t)len;
     }
     case SIGN_TBLSEP:
     case SIGN_TBLEND: {
@@ -864,266 +6582,476 @@ static size_t load(jmp_buf E, lua_State* L, const char* B, size_t buflen)
 }
 
 
-static size_t load_x(jmp_buf E, lua_State* L, const char* B, size_t buflen)
+/*
+** Inflates the frames of a compressed object into the arena, returning
+** their length.
+*/
+static size_t treeinflate(jmp_buf E, lostree* T, const char* B, size_t buflen,
+                          const char** raw, size_t* rawlen)
 {
-    if (buflen == 0) {
-        los_throw(E, LOS_ESRC);
+    size_t pos = 0;
+    size_t total = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        pos = 0;
+        char* p = pass ? treealloc(E, T, total) : NULL;
+        *raw = p;
+        for (;;) {
+            size_t n;
+            size_t complen;
+            size_t f = lzframelen(E, B + pos, buflen - pos, &n, &complen);
+            if (f == 0 || f > buflen - pos) {
+                los_throw(E, LOS_ESRC);
+            }
+            if (n == 0) {
+                pos += f;
+                break;
+            }
+            if (pass == 0) {
+                total += n;
+            }
+            else if (complen) {
+                lzinflate(E, B + pos + f - complen, complen, p, n);
+                p += n;
+            }
+            else {
+                memcpy(p, B + pos + f - n, n);
+                p += n;
+            }
+            pos += f;
+        }
     }
-    char c = B[0];
-    if (IS_SHRINT(c)) {
-        lua_pushinteger(L, c);
-        return 1;
+    *rawlen = total;
+    return pos;
+}
+
+
+static void treefree(lostree* T)
+{
+    free(T->stack);
+    free(T->strs);
+    free(T->shapes);
+    T->stack = NULL;
+    T->strs = NULL;
+    T->shapes = NULL;
+}
+
+
+static void treeinit(lostree* T, int flags, int swap)
+{
+    memset(T, 0, sizeof(lostree));
+    T->flags = flags;
+    T->swap = swap;
+}
+
+
+/*
+** Parses the object at B into T, returning its length.
+*/
+static size_t treeobject(jmp_buf E, lostree* T, const char* B, size_t size)
+{
+    size_t pos = readhdr(E, B, size, &T->flags);
+    if (T->flags & FLAG_LZ) {
+        T->flags &= ~FLAG_LZ;
+        const char* raw;
+        size_t rawlen;
+        pos += treeinflate(E, T, B + pos, size - pos, &raw, &rawlen);
+        if (treevalue(E, T, raw, rawlen) != rawlen) {
+            los_throw(E, LOS_ESIGN);
+        }
     }
-    if (IS_SHRSTR(c)) {
-        c &= ~MASK_SHRSTR;
-        size_t len = c;
-        checksrclen(buflen, 1 + len);
-        lua_pushlstring(L, B + 1, len);
-        return 1 + len;
+    else {
+        pos += treevalue(E, T, B + pos, size - pos);
     }
-    int sign = (uint8_t)c;
-    switch (sign)
-    {
-    case SIGN_NIL: {
-        lua_pushnil(L);
-        return 1;
+    T->root = T->stack[0];
+    return pos;
+}
+
+
+/*
+** Frees everything T holds, leaving it empty.
+*/
+static void treeclear(lostree* T)
+{
+    treefree(T);
+    losblock* b = T->blocks;
+    while (b) {
+        losblock* next = b->next;
+        free(b);
+        b = next;
     }
-    case SIGN_FALSE: {
-        lua_pushboolean(L, 0);
-        return 1;
+    T->blocks = NULL;
+}
+
+
+LUA_MOD_EXPORT void los_freetree(lostree* T)
+{
+    if (T == NULL) {
+        return;
     }
-    case SIGN_TRUE: {
-        lua_pushboolean(L, 1);
-        return 1;
+    treeclear(T);
+    free(T);
+}
+
+
+/*
+** Parses the object at the start of buf, written in the other byte order
+** if swap is set. It returns 0 and sets *tree and *len, the length of the
+** object, or returns an error code.
+*/
+LUA_MOD_EXPORT int los_parse(const char* buf, size_t size, int swap, lostree** tree, size_t* len)
+{
+    lostree* T = malloc(sizeof(lostree));
+    if (T == NULL) {
+        return LOS_EMEM;
     }
-    case SIGN_INT1: {
-        checksrclen(buflen, 2);
-        lua_pushinteger(L, B[1]);
-        return 2;
+    treeinit(T, 0, swap);
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        los_freetree(T);
+        return err;
     }
-    case SIGN_INT2: {
-        checksrclen(buflen, 3);
-        ucast u = (ucast){
-            .i8[0] = B[2],
-            .i8[1] = B[1],
-        };
-        lua_pushinteger(L, u.i16[0]);
-        return 3;
+    T->len = treeobject(E, T, buf, size);
+    treefree(T);
+    *tree = T;
+    *len = T->len;
+    return 0;
+}
+
+
+/*
+** Pushes the value of node N. The tables numbered for refs are kept in
+** the table at made.
+*/
+static void treepushnode(lua_State* L, const lostree* T, const losnode* N, int made)
+{
+    switch (N->type)
+    {
+    case NODE_NIL: {
+        lua_pushnil(L);
+        break;
     }
-    case SIGN_INT4: {
-        checksrclen(buflen, 5);
-        ucast u = (ucast){
-            .i8[0] = B[4],
-            .i8[1] = B[3],
-            .i8[2] = B[2],
-            .i8[3] = B[1],
-        };
-        lua_pushinteger(L, u.i32[0]);
-        return 5;
-    } 
-    case SIGN_INT8: {
-        checksrclen(buflen, 9);
-        ucast u = (ucast){
-            .i8[0] = B[8],
-            .i8[1] = B[7],
-            .i8[2] = B[6],
-            .i8[3] = B[5],
-            .i8[4] = B[4],
-            .i8[5] = B[3],
-            .i8[6] = B[2],
-            .i8[7] = B[1],
-        };
-        lua_pushinteger(L, u.i64);
-        return 9;
+    case NODE_FALSE:
+    case NODE_TRUE: {
+        lua_pushboolean(L, N->type == NODE_TRUE);
+        break;
     }
-    case SIGN_STR1: {
-        checksrclen(buflen, 2);
-        size_t len = B[1];
-        checksrclen(buflen, 2 + len);
-        lua_pushlstring(L, B + 2, len);
-        return 2 + len;
+    case NODE_INT: {
+        lua_pushinteger(L, N->u.i);
+        break;
     }
-    case SIGN_STR2: {
-        checksrclen(buflen, 3);
-        ucast u = (ucast){
-            .u8[0] = B[2],
-            .u8[1] = B[1],
-        };
-        size_t len = u.u16[0];
-        checksrclen(buflen, 3 + len);
-        lua_pushlstring(L, B + 3, len);
-        return 3 + len;
+    case NODE_FLT: {
+        lua_pushnumber(L, N->u.d);
+        break;
     }
-    case SIGN_STR4: {
-        checksrclen(buflen, 5);
-        ucast u = (ucast){
-            .u8[0] = B[4],
-            .u8[1] = B[3],
-            .u8[2] = B[2],
-            .u8[3] = B[1],
-        };
-        size_t len = u.u32[0];
-        checksrclen(buflen, 5 + len);
-        lua_pushlstring(L, B + 5, len);
-        return 5 + len;
+    case NODE_STR: {
+        lua_pushlstring(L, N->u.str.s, N->u.str.len);
+        break;
     }
-    case SIGN_FLT: {
-        checksrclen(buflen, 9);
-        ucast u = (ucast){
-            .u8[0] = B[8],
-            .u8[1] = B[7],
-            .u8[2] = B[6],
-            .u8[3] = B[5],
-            .u8[4] = B[4],
-            .u8[5] = B[3],
-            .u8[6] = B[2],
-            .u8[7] = B[1],
-        };
-        lua_pushnumber(L, u.f);
-        return 9;
+    case NODE_REF: {
+        lua_rawgeti(L, made, (lua_Integer)N->u.ref);
+        break;
     }
-    case SIGN_TBLBEG: {
-        size_t total = 1;
-        size_t consume = 0;
-        lua_newtable(L);
-        int i = 1;
-        while (consume = load_x(E, L, B + total, buflen - total)) {
-            lua_rawseti(L, -2, i++);
-            total += consume;
+    case NODE_ARR: {
+        luaL_checkstack(L, 2, NULL);
+        lua_createtable(L, (int)N->u.arr.n, 0);
+        if (N->u.arr.id) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, made, (lua_Integer)N->u.arr.id);
         }
-        ++total;
-        while (consume = load_x(E, L, B + total, buflen - total)) {
-            total += consume;
-            consume = load_x(E, L, B + total, buflen - total);
-            if (consume == 0) {
-                los_throw(E, LOS_ESRC);
-            }
-            total += consume;
-            lua_rotate(L, -2, 1);
+        const char* p = N->u.arr.p;
+        for (size_t i = 1; i <= N->u.arr.n; i += ARRAY_CHUNK) {
+            size_t n = N->u.arr.n - i + 1 < ARRAY_CHUNK ? N->u.arr.n - i + 1 : ARRAY_CHUNK;
+            unpackchunk(L, p, i, n, N->u.arr.type, T->swap);
+            p += arraylen(n, N->u.arr.type);
+        }
+        break;
+    }
+    default: {
+        luaL_checkstack(L, 3, NULL);
+        size_t narr = N->u.tbl.narr;
+        size_t nrec = N->u.tbl.nrec;
+        lua_createtable(L, narr > INT_MAX ? INT_MAX : (int)narr, nrec > INT_MAX ? INT_MAX : (int)nrec);
+        if (N->u.tbl.id) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, made, (lua_Integer)N->u.tbl.id);
+        }
+        const losnode* items = N->u.tbl.items;
+        for (size_t i = 0; i < narr; ++i) {
+            treepushnode(L, T, &items[i], made);
+            lua_rawseti(L, -2, (lua_Integer)i + 1);
+        }
+        items += narr;
+        for (size_t i = 0; i < nrec; ++i) {
+            treepushnode(L, T, &items[2 * i], made);
+            treepushnode(L, T, &items[2 * i + 1], made);
             lua_rawset(L, -3);
         }
-        ++total;
-        return total;
     }
-    case SIGN_TBLSEP:
-    case SIGN_TBLEND: {
-        return 0;
     }
-    default: {
-        los_throw(E, LOS_ESIGN);
+}
+
+
+/*
+** Pushes the value of a tree onto the stack of L. The tree stays valid.
+*/
+LUA_MOD_EXPORT void los_pushtree(lua_State* L, const lostree* T)
+{
+    luaL_checkstack(L, 2, NULL);
+    lua_newtable(L);
+    int made = lua_gettop(L);
+    treepushnode(L, T, &T->root, made);
+    lua_remove(L, made);
+}
+
+
+/*
+** Parallel load. With threads asked for, the array part of a large
+** top-level table is cut into runs of about the same length in bytes,
+** each parsed into a value tree by a thread of its own. A run ends at the
+** first item ending past its share, or at the end of the array part. The
+** calling thread skips over the items to find where each run starts,
+** starting its thread as soon as it does, then pushes the trees in order
+** and loads the hash part itself. Creating the Lua values stays on one
+** thread: what is spread over the threads is the decoding. Strings,
+** tables and shapes written by dedup, refs and shapes are numbered across
+** the whole object and compressed objects are inflated a block at a time,
+** so those and anything small are loaded on one thread. So is an object
+** the runs fail on, so that threads never change what load accepts.
+*/
+#ifndef _WIN32
+
+#define SPLIT_MINSIZE 65536
+#define SPLIT_MINRUN  4096
+
+#define LOSSPLIT_META "los.split"
+
+typedef struct losjob
+{
+    lostree T;
+    const char* B;
+    size_t buflen;
+    size_t limit;
+    size_t len;
+    int    err;
+    int    started;
+    pthread_t thread;
+} losjob;
+
+typedef struct lossplit
+{
+    int njob;
+    int nstart;
+    losjob jobs[];
+} lossplit;
+
+
+/*
+** Parses items until they reach limit bytes or the end of the array part,
+** setting their length.
+*/
+static void* splitjob(void* ud)
+{
+    losjob* J = ud;
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        J->err = err;
+        return NULL;
+    }
+    size_t pos = 0;
+    size_t n;
+    while (pos < J->limit && (n = treenext(E, &J->T, J->B + pos, J->buflen - pos))) {
+        pos += n;
+    }
+    J->len = pos;
+    return NULL;
+}
+
+
+/*
+** Starts the jobs of the table at B, right after its SIGN_TBLBEG, skipping
+** items the way a job parses them to find where the next job starts, and
+** stopping early at the end of the array part. It sets where the items
+** start, after the size hint if any, and the hash count of the hint, and
+** returns an error code if the table can't be skipped. A job whose
+** thread can't be started is run here.
+*/
+static int splitstart(lossplit* S, const char* B, size_t buflen, int swap, size_t* first, int64_t* nrec)
+{
+    jmp_buf E;
+    int err = setjmp(E);
+    if (err != 0) {
+        return err;
+    }
+    size_t pos = 0;
+    *nrec = 0;
+    if (buflen > 0 && (uint8_t)B[0] == SIGN_TBLSIZ) {
+        int64_t narr;
+        pos = 1;
+        pos += readint(E, B + pos, buflen - pos, swap, &narr);
+        pos += readint(E, B + pos, buflen - pos, swap, nrec);
+        if (narr < 0 || *nrec < 0) {
+            return LOS_ESIGN;
+        }
     }
+    *first = pos;
+    size_t per = (buflen - pos) / S->njob;
+    while (S->nstart < S->njob) {
+        losjob* J = &S->jobs[S->nstart++];
+        J->B = B + pos;
+        J->buflen = buflen - pos;
+        J->limit = S->nstart < S->njob ? per : SIZE_MAX;
+        J->started = pthread_create(&J->thread, NULL, splitjob, J) == 0;
+        if (!J->started) {
+            splitjob(J);
+        }
+        size_t start = pos;
+        while (S->nstart < S->njob && pos - start < per) {
+            checksrclen(buflen - pos, 1);
+            if ((uint8_t)B[pos] == SIGN_TBLSEP) {
+                return 0;
+            }
+            pos += skipvalue(E, B + pos, buflen - pos, swap);
+        }
     }
     return 0;
 }
 
 
-static int los_dump(lua_State* L)
+static void splitjoin(lossplit* S)
 {
-    jmp_buf E;
-    los_try(E);
-    luaL_checkany(L, 1);
-    if (lua_islightuserdata(L, 1)) {
-        char* B = lua_touserdata(L, 1);
-        size_t offset = luaL_checkinteger(L, 2);
-        size_t size = luaL_checkinteger(L, 3);
-        luaL_checkany(L, 4);
-        lua_settop(L, 4);
-        size_t len = dumpbuf(E, L, B + offset, size);
-        lua_pushinteger(L, len);
-        return 1;
-    }
-    else {
-        lua_settop(L, 1);
-        luaL_Buffer B;
-        luaL_buffinit(L, &B);
-        size_t len = dump(E, L, &B);
-        lua_pushinteger(L, len);
-        luaL_pushresult(&B);
-        return 2;
+    for (int k = 0; k < S->nstart; ++k) {
+        losjob* J = &S->jobs[k];
+        if (J->started) {
+            pthread_join(J->thread, NULL);
+            J->started = 0;
+        }
     }
 }
 
 
-static int los_dump_x(lua_State* L)
+static int los_split_gc(lua_State* L)
 {
-    jmp_buf E;
-    los_try(E);
-    luaL_checkany(L, 1);
-    if (lua_islightuserdata(L, 1)) {
-        char* B = lua_touserdata(L, 1);
-        size_t offset = luaL_checkinteger(L, 2);
-        size_t size = luaL_checkinteger(L, 3);
-        luaL_checkany(L, 4);
-        lua_settop(L, 4);
-        size_t len = dumpbuf_x(E, L, B + offset, size);
-        lua_pushinteger(L, len);
-        return 1;
-    }
-    else {
-        lua_settop(L, 1);
-        luaL_Buffer B;
-        luaL_buffinit(L, &B);
-        size_t len = dump_x(E, L, &B);
-        lua_pushinteger(L, len);
-        luaL_pushresult(&B);
-        return 2;
+    lossplit* S = lua_touserdata(L, 1);
+    splitjoin(S);
+    for (int k = 0; k < S->njob; ++k) {
+        treeclear(&S->jobs[k].T);
     }
+    return 0;
 }
 
 
-static int los_load(lua_State* L)
+/*
+** Loads the object at B as loadobject does, decoding the array part of a
+** large top-level table on up to threads threads.
+*/
+static size_t loadsplit(jmp_buf E, lua_State* L, const char* B, size_t size, int swap, int threads)
 {
-    jmp_buf E;
-    los_try(E);
-    luaL_checkany(L, 1);
-    if (lua_islightuserdata(L, 1)) {
-        const char* B = lua_touserdata(L, 1);
-        size_t size = luaL_checkinteger(L, 2);
-        lua_settop(L, 2);
-        size_t consume = load(E, L, B, size);
-        lua_pushinteger(L, consume);
-        lua_rotate(L, -2, 1);
-        return 2;
+    int flags;
+    size_t pos = readhdr(E, B, size, &flags);
+    if (threads <= 1 || size - pos < SPLIT_MINSIZE
+        || (flags & (FLAG_STRREF | FLAG_TBLREF | FLAG_SHAPE | FLAG_LZ))) {
+        return loadobject(E, L, B, size, swap);
     }
-    else {
-        luaL_argexpected(L, lua_isstring(L, 1), 1, lua_typename(L, LUA_TSTRING));
-        lua_settop(L, 1);
-        size_t size;
-        const char* B = lua_tolstring(L, -1, &size);
-        size_t consume = load(E, L, B, size);
-        lua_pushinteger(L, consume);
+    size_t end = size;
+    int indexed = (uint8_t)B[pos] == SIGN_INDEX;
+    if (indexed) {
+        uint64_t len;
+        size_t n = 1 + getvarint(E, B + pos + 1, size - pos - 1, &len);
+        checksrclen(size - pos - n, len);
+        end = pos + n + (size_t)len;
+        pos += n;
+    }
+    if (end - pos < 2 || (uint8_t)B[pos] != SIGN_TBLBEG) {
+        return loadobject(E, L, B, size, swap);
+    }
+    size_t p = pos + 1;
+    size_t maxjob = (end - p) / SPLIT_MINRUN;
+    int njob = maxjob < (size_t)threads ? (int)maxjob : threads;
+    luaL_checkstack(L, 4, NULL);
+    int top = lua_gettop(L);
+    lossplit* S = lua_newuserdatauv(L, sizeof(lossplit) + njob * sizeof(losjob), 0);
+    S->njob = njob;
+    S->nstart = 0;
+    for (int k = 0; k < njob; ++k) {
+        losjob* J = &S->jobs[k];
+        treeinit(&J->T, flags, swap);
+        J->err = 0;
+        J->started = 0;
+        J->len = 0;
+    }
+    luaL_setmetatable(L, LOSSPLIT_META);
+    size_t first;
+    int64_t nrec;
+    int bad = splitstart(S, B + p, end - p, swap, &first, &nrec) != 0;
+    splitjoin(S);
+    p += first;
+    size_t count = 0;
+    for (int k = 0; k < S->nstart && !bad; ++k) {
+        losjob* J = &S->jobs[k];
+        bad = J->err != 0 || J->B != B + p;
+        p += J->len;
+        count += J->T.nstack;
+    }
+    if (bad || p >= end || (uint8_t)B[p] != SIGN_TBLSEP) {
+        lua_settop(L, top);
+        return loadobject(E, L, B, size, swap);
+    }
+    losctx C;
+    ctxinit(L, &C, flags);
+    size_t hint = (end - p) / 2 < (uint64_t)nrec ? (end - p) / 2 : (size_t)nrec;
+    lua_createtable(L, count > INT_MAX ? INT_MAX : (int)count, hint > INT_MAX ? INT_MAX : (int)hint);
+    lua_Integer i = 1;
+    for (int k = 0; k < S->nstart; ++k) {
+        lostree* T = &S->jobs[k].T;
+        for (size_t j = 0; j < T->nstack; ++j) {
+            treepushnode(L, T, &T->stack[j], 0);
+            lua_rawseti(L, -2, i++);
+        }
+        treeclear(T);
+    }
+    ++p;
+    size_t consume;
+    while (consume = loadnext(swap)(E, L, B + p, end - p, &C)) {
+        p += consume;
+        consume = loadnext(swap)(E, L, B + p, end - p, &C);
+        if (consume == 0) {
+            los_throw(E, LOS_ESRC);
+        }
+        p += consume;
         lua_rotate(L, -2, 1);
-        return 2;
+        lua_rawset(L, -3);
     }
+    ++p;
+    return indexed ? end : p;
 }
 
 
-static int los_load_x(lua_State* L)
+static void los_opensplit(lua_State* L)
 {
-    jmp_buf E;
-    los_try(E);
-    luaL_checkany(L, 1);
-    if (lua_islightuserdata(L, 1)) {
-        const char* B = lua_touserdata(L, 1);
-        size_t size = luaL_checkinteger(L, 2);
-        lua_settop(L, 2);
-        size_t consume = load_x(E, L, B, size);
-        lua_pushinteger(L, consume);
-        lua_rotate(L, -2, 1);
-        return 2;
-    }
-    else {
-        luaL_argexpected(L, lua_isstring(L, 1), 1, lua_typename(L, LUA_TSTRING));
-        lua_settop(L, 1);
-        size_t size;
-        const char* B = lua_tolstring(L, -1, &size);
-        size_t consume = load_x(E, L, B, size);
-        lua_pushinteger(L, consume);
-        lua_rotate(L, -2, 1);
-        return 2;
-    }
+    luaL_newmetatable(L, LOSSPLIT_META);
+    lua_pushcfunction(L, los_split_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
+
+#else
+
+static size_t loadsplit(jmp_buf E, lua_State* L, const char* B, size_t size, int swap, int threads)
+{
+    (void)threads;
+    return loadobject(E, L, B, size, swap);
+}
+
+
+static void los_opensplit(lua_State* L)
+{
+    (void)L;
 }
 
+#endif
+
 
 static int los_setendian(lua_State* L)
 {
@@ -1134,22 +7062,44 @@ static int los_setendian(lua_State* L)
     int top = lua_gettop(L);
     if (top >= 2) {
         const char* endian = luaL_checkstring(L, 2);
-        if (strncmp(endian, "le", 2)) {
+        if (strncmp(endian, "le", 2) == 0) {
             target_endian = ENDIAN_LE;
         }
-        else if (strncmp(endian, "be", 2)) {
+        else if (strncmp(endian, "be", 2) == 0) {
             target_endian = ENDIAN_BE;
         }
         else {
-            luaL_argerror(L, 1, "invalid endian");
+            luaL_argerror(L, 2, "invalid endian");
             return 0;
         }
     }
     int eq = local_endian == target_endian;
     lua_pushcfunction(L, eq ? los_dump : los_dump_x);
     lua_setfield(L, 1, "dump");
+    lua_pushcfunction(L, eq ? los_dumpto : los_dumpto_x);
+    lua_setfield(L, 1, "dumpto");
     lua_pushcfunction(L, eq ? los_load : los_load_x);
     lua_setfield(L, 1, "load");
+    lua_pushcfunction(L, eq ? los_dumpmany : los_dumpmany_x);
+    lua_setfield(L, 1, "dumpmany");
+    lua_pushcfunction(L, eq ? los_iter : los_iter_x);
+    lua_setfield(L, 1, "iter");
+    lua_pushcfunction(L, eq ? los_loadfile : los_loadfile_x);
+    lua_setfield(L, 1, "loadfile");
+    lua_pushcfunction(L, eq ? los_dumpfile : los_dumpfile_x);
+    lua_setfield(L, 1, "dumpfile");
+    lua_pushcfunction(L, eq ? los_encoder : los_encoder_x);
+    lua_setfield(L, 1, "encoder");
+    lua_pushcfunction(L, eq ? los_decoder : los_decoder_x);
+    lua_setfield(L, 1, "decoder");
+    lua_pushcfunction(L, eq ? los_view : los_view_x);
+    lua_setfield(L, 1, "view");
+    lua_pushcfunction(L, eq ? los_get : los_get_x);
+    lua_setfield(L, 1, "get");
+    lua_pushcfunction(L, eq ? los_validate : los_validate_x);
+    lua_setfield(L, 1, "validate");
+    lua_pushcfunction(L, eq ? los_length : los_length_x);
+    lua_setfield(L, 1, "length");
     lua_pushstring(L, local_endian == ENDIAN_LE ? "le" : "be");
     lua_setfield(L, 1, "local_endian");
     lua_pushstring(L, target_endian == ENDIAN_LE ? "le" : "be");
@@ -1158,43 +7108,213 @@ static int los_setendian(lua_State* L)
 }
 
 
-size_t pack(jmp_buf E, lua_State* L, luaL_Buffer* B)
+/*
+** Scalar formatters for pack. They write the same text string.format("%q")
+** does: decimal integers, hexadecimal floats and quoted strings with
+** escapes, straight into the output instead of through a Lua call.
+*/
+#define FMTNUM_MAXLEN 32
+
+#define iscntrlchar(c) ((uint8_t)(c) < 0x20 || (uint8_t)(c) == 0x7f)
+#define isdigitchar(c) ((uint8_t)((c) - '0') < 10)
+
+static const char hexdigits[] = "0123456789abcdef";
+
+
+static size_t fmtint(char* s, int64_t v)
+{
+    if (v == INT64_MIN) {
+        memcpy(s, "0x8000000000000000", 18);
+        return 18;
+    }
+    char tmp[20];
+    uint64_t u = v < 0 ? (uint64_t)-v : (uint64_t)v;
+    size_t n = 0;
+    do {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    size_t len = 0;
+    if (v < 0) {
+        s[len++] = '-';
+    }
+    while (n > 0) {
+        s[len++] = tmp[--n];
+    }
+    return len;
+}
+
+
+static size_t fmtflt(char* s, double v)
+{
+    ucast u = (ucast){ .f = v };
+    uint64_t mant = u.u64 & 0x000fffffffffffffULL;
+    int exp = (int)((u.u64 >> 52) & 0x7ff);
+    int neg = (int)(u.u64 >> 63);
+    if (exp == 0x7ff) {
+        if (mant != 0) {
+            memcpy(s, "(0/0)", 5);
+            return 5;
+        }
+        else if (neg) {
+            memcpy(s, "-1e9999", 7);
+            return 7;
+        }
+        else {
+            memcpy(s, "1e9999", 6);
+            return 6;
+        }
+    }
+    size_t len = 0;
+    if (neg) {
+        s[len++] = '-';
+    }
+    s[len++] = '0';
+    s[len++] = 'x';
+    if (exp == 0) {
+        s[len++] = '0';
+        exp = mant != 0 ? -1022 : 0;
+    }
+    else {
+        s[len++] = '1';
+        exp -= 1023;
+    }
+    if (mant != 0) {
+        s[len++] = '.';
+        while (mant != 0) {
+            s[len++] = hexdigits[mant >> 48];
+            mant = (mant << 4) & 0x000fffffffffffffULL;
+        }
+    }
+    s[len++] = 'p';
+    if (exp < 0) {
+        s[len++] = '-';
+        exp = -exp;
+    }
+    else {
+        s[len++] = '+';
+    }
+    return len + fmtint(s + len, exp);
+}
+
+
+static size_t fmtnum(lua_State* L, char* s)
+{
+    if (lua_isinteger(L, -1)) {
+        return fmtint(s, lua_tointeger(L, -1));
+    }
+    else {
+        return fmtflt(s, lua_tonumber(L, -1));
+    }
+}
+
+
+static size_t quotelen(const char* s, size_t len)
+{
+    size_t size = len + 2;
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t c = (uint8_t)s[i];
+        if (c == '"' || c == '\\' || c == '\n') {
+            size += 1;
+        }
+        else if (iscntrlchar(c)) {
+            if (i + 1 < len && isdigitchar(s[i + 1])) {
+                size += 3;
+            }
+            else {
+                size += c < 10 ? 1 : c < 100 ? 2 : 3;
+            }
+        }
+    }
+    return size;
+}
+
+
+static void fmtstr(char* d, const char* s, size_t len)
+{
+    *d++ = '"';
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t c = (uint8_t)s[i];
+        if (c == '"' || c == '\\' || c == '\n') {
+            *d++ = '\\';
+            *d++ = (char)c;
+        }
+        else if (iscntrlchar(c)) {
+            *d++ = '\\';
+            if (i + 1 < len && isdigitchar(s[i + 1])) {
+                *d++ = (char)('0' + c / 100);
+                *d++ = (char)('0' + c / 10 % 10);
+            }
+            else if (c >= 100) {
+                *d++ = (char)('0' + c / 100);
+                *d++ = (char)('0' + c / 10 % 10);
+            }
+            else if (c >= 10) {
+                *d++ = (char)('0' + c / 10);
+            }
+            *d++ = (char)('0' + c % 10);
+        }
+        else {
+            *d++ = (char)c;
+        }
+    }
+    *d = '"';
+}
+
+
+/*
+** pack takes only canonical of the options of dump.
+*/
+static int packopts(lua_State* L, int idx)
+{
+    if (lua_isnoneornil(L, idx)) {
+        return 0;
+    }
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "canonical");
+    int flags = lua_toboolean(L, -1) ? OPT_CANON : 0;
+    lua_pop(L, 1);
+    return flags;
+}
+
+
+size_t pack(jmp_buf E, lua_State* L, losbuf* B, losctx* C)
 {
     int type = lua_type(L, -1);
     switch (type)
     {
     case LUA_TNIL: {
-        luaL_addstring(B, "nil");
+        losbuf_addliteral(B, "nil");
         return 3;
     }
     case LUA_TBOOLEAN: {
         if (lua_toboolean(L, -1)) {
-            luaL_addstring(B, "true");
+            losbuf_addliteral(B, "true");
             return 4;
         }
         else {
-            luaL_addstring(B, "false");
+            losbuf_addliteral(B, "false");
             return 5;
         }
     }
-    case LUA_TNUMBER:
+    case LUA_TNUMBER: {
+        size_t len = fmtnum(L, losbuf_prep(B, FMTNUM_MAXLEN));
+        B->n += len;
+        return len;
+    }
     case LUA_TSTRING: {
-        lua_pushcfunction(L, str_format);
-        lua_pushstring(L, "%q");
-        lua_pushvalue(L, -3);
-        if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
-            los_throw(E, LOS_EFMT);
-        }
         size_t len;
         const char* s = lua_tolstring(L, -1, &len);
-        luaL_addstring(B, s);
-        lua_pop(L, 1);
-        return len;
+        size_t size = quotelen(s, len);
+        fmtstr(losbuf_prep(B, size), s, len);
+        B->n += size;
+        return size;
     }
     case LUA_TTABLE: {
-        luaL_addchar(B, '{');
+        luaL_checkstack(L, 3, NULL);
+        losbuf_addchar(B, '{');
         size_t size = 1;
-        size_t len = lua_rawlen(L, -1);
+        size_t len = tablelen(L, C);
         size_t numnil = 0;
         int comma = 0;
         for (size_t i = 1; i <= len; ++i) {
@@ -1203,49 +7323,48 @@ size_t pack(jmp_buf E, lua_State* L, luaL_Buffer* B)
             }
             else {
                 if (comma) {
-                    luaL_addchar(B, ',');
+                    losbuf_addchar(B, ',');
                     ++size;
                 }
                 else {
                     comma = 1;
                 }
                 for (size_t j = 0; j < numnil; ++j) {
-                    luaL_addstring(B, "nil,");
+                    losbuf_addliteral(B, "nil,");
                 }
                 size += numnil * 4;
                 numnil = 0;
-                size += pack(E, L, B);
+                size += pack(E, L, B, C);
             }
             lua_pop(L, 1);
         }
         int top = lua_gettop(L);
-        if (len > 0) {
-            size_t lastkey = len - numnil;
-            lua_pushinteger(L, lastkey);
-        }
-        else {
-            lua_pushnil(L);
-        }
-        while (lua_next(L, -2)) {
+        lositer I;
+        hashfirst(L, C, &I, top, len);
+        while (hashnext(L, C, &I, top)) {
+            if (isarraykey(L, len)) {
+                lua_pop(L, 1);
+                continue;
+            }
             if (comma) {
-                luaL_addchar(B, ',');
+                losbuf_addchar(B, ',');
                 ++size;
             }
             else {
                 comma = 1;
             }
             lua_rotate(L, -2, 1);
-            luaL_addchar(B, '[');
+            losbuf_addchar(B, '[');
             ++size;
-            size += pack(E, L, B);
-            luaL_addstring(B, "]=");
+            size += pack(E, L, B, C);
+            losbuf_addliteral(B, "]=");
             size += 2;
             lua_rotate(L, -2, 1);
-            size += pack(E, L, B);
+            size += pack(E, L, B, C);
             lua_pop(L, 1);
         }
         lua_settop(L, top);
-        luaL_addchar(B, '}');
+        losbuf_addchar(B, '}');
         ++size;
         return size;
     }
@@ -1257,7 +7376,7 @@ size_t pack(jmp_buf E, lua_State* L, luaL_Buffer* B)
 }
 
 
-static size_t packbuf(jmp_buf E, lua_State* L, char* B, size_t buflen)
+static size_t packbuf(jmp_buf E, lua_State* L, char* B, size_t buflen, losctx* C)
 {
     int type = lua_type(L, -1);
     switch (type)
@@ -1279,7 +7398,7 @@ static size_t packbuf(jmp_buf E, lua_State* L, char* B, size_t buflen)
             return 4;
         }
         else {
-            checkdestlen(buflen, 4);
+            checkdestlen(buflen, 5);
             B[0] = 'f';
             B[1] = 'a';
             B[2] = 'l';
@@ -1288,25 +7407,27 @@ static size_t packbuf(jmp_buf E, lua_State* L, char* B, size_t buflen)
             return 5;
         }
     }
-    case LUA_TNUMBER:
-    case LUA_TSTRING: {
-        lua_pushcfunction(L, str_format);
-        lua_pushstring(L, "%q");
-        lua_pushvalue(L, -3);
-        if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
-            los_throw(E, LOS_EFMT);
-        }
-        size_t len;
-        const char* s = lua_tolstring(L, -1, &len);
+    case LUA_TNUMBER: {
+        char s[FMTNUM_MAXLEN];
+        size_t len = fmtnum(L, s);
         checkdestlen(buflen, len);
         memcpy(B, s, len);
         return len;
     }
+    case LUA_TSTRING: {
+        size_t len;
+        const char* s = lua_tolstring(L, -1, &len);
+        size_t size = quotelen(s, len);
+        checkdestlen(buflen, size);
+        fmtstr(B, s, len);
+        return size;
+    }
     case LUA_TTABLE: {
+        luaL_checkstack(L, 3, NULL);
         checkdestlen(buflen, 1);
         B[0] = '{';
         size_t size = 1;
-        size_t len = lua_rawlen(L, -1);
+        size_t len = tablelen(L, C);
         size_t numnil = 0;
         for (size_t i = 1; i <= len; ++i) {
             if (lua_rawgeti(L, -1, i) == LUA_TNIL) {
@@ -1323,7 +7444,7 @@ static size_t packbuf(jmp_buf E, lua_State* L, char* B, size_t buflen)
                 }
                 size += numnil * 4;
                 numnil = 0;
-                size += packbuf(E, L, B + size, buflen - size);
+                size += packbuf(E, L, B + size, buflen - size, C);
                 checkdestlen(buflen - size, 1);
                 B[size] = ',';
                 ++size;
@@ -1331,25 +7452,24 @@ static size_t packbuf(jmp_buf E, lua_State* L, char* B, size_t buflen)
             lua_pop(L, 1);
         }
         int top = lua_gettop(L);
-        if (len > 0) {
-            size_t lastkey = len - numnil;
-            lua_pushinteger(L, lastkey);
-        }
-        else {
-            lua_pushnil(L);
-        }
-        while (lua_next(L, -2)) {
+        lositer I;
+        hashfirst(L, C, &I, top, len);
+        while (hashnext(L, C, &I, top)) {
+            if (isarraykey(L, len)) {
+                lua_pop(L, 1);
+                continue;
+            }
             lua_rotate(L, -2, 1);
             checkdestlen(buflen - size, 1);
             B[size] = '[';
             ++size;
-            size += packbuf(E, L, B + size, buflen - size);
+            size += packbuf(E, L, B + size, buflen - size, C);
             checkdestlen(buflen - size, 2);
             B[size] = ']';
             B[size + 1] = '=';
             size += 2;
             lua_rotate(L, -2, 1);
-            size += packbuf(E, L, B + size, buflen - size);
+            size += packbuf(E, L, B + size, buflen - size, C);
             checkdestlen(buflen - size, 1);
             B[size] = ',';
             ++size;
@@ -1374,6 +7494,58 @@ static size_t packbuf(jmp_buf E, lua_State* L, char* B, size_t buflen)
 }
 
 
+static size_t unquote(jmp_buf E, lua_State* L, const char* B, size_t buflen)
+{
+    losbuf S;
+    losbuf_init(L, &S);
+    size_t i = 1;
+    while (i < buflen) {
+        char c = B[i++];
+        if (c == '"') {
+            losbuf_pushresult(&S);
+            lua_replace(L, S.box);
+            return i;
+        }
+        if (c != '\\') {
+            losbuf_addchar(&S, c);
+            continue;
+        }
+        checksrclen(buflen - i, 1);
+        c = B[i++];
+        switch (c)
+        {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+        case '\n':
+        case '\\':
+        case '"':
+        case '\'': break;
+        default: {
+            if (!isdigitchar(c)) {
+                los_throw(E, LOS_ESIGN);
+            }
+            int v = c - '0';
+            for (int j = 1; j < 3 && i < buflen && isdigitchar(B[i]); ++j) {
+                v = v * 10 + (B[i++] - '0');
+            }
+            if (v > UINT8_MAX) {
+                los_throw(E, LOS_ESIGN);
+            }
+            c = (char)v;
+        }
+        }
+        losbuf_addchar(&S, c);
+    }
+    los_throw(E, LOS_ESRC);
+    return 0;
+}
+
+
 static size_t unpack(jmp_buf E, lua_State* L, const char* B, size_t buflen)
 {
     if (buflen == 0) {
@@ -1382,14 +7554,18 @@ static size_t unpack(jmp_buf E, lua_State* L, const char* B, size_t buflen)
     char c = B[0];
     if (c == '"') {
         for (size_t i = 1; i < buflen; ++i) {
-            if (B[i] == '"' && B[i - 1] != '\\') {
+            if (B[i] == '"') {
                 lua_pushlstring(L, B + 1, i - 1);
                 return i + 1;
             }
+            if (B[i] == '\\') {
+                return unquote(E, L, B, buflen);
+            }
         }
         los_throw(E, LOS_ESRC);
     }
     else if (c == '{') {
+        luaL_checkstack(L, 3, NULL);
         lua_newtable(L);
         size_t i = 1;
         size_t k = 1;
@@ -1469,25 +7645,17 @@ static size_t unpack(jmp_buf E, lua_State* L, const char* B, size_t buflen)
                 lua_pushboolean(L, 0);
                 return comma ? 6 : 5;
             }
-        }
-        lua_pushlstring(L, B, i);
-        int isnum;
-        if (B[0] == '0') {
-            lua_Number f = lua_tonumberx(L, -1, &isnum);
-            if (!isnum) {
-                los_throw(E, LOS_ESIGN);
+            if (memcmp(B, "(0/0)", 5) == 0) {
+                lua_pushnumber(L, NAN);
+                return comma ? 6 : 5;
             }
-            lua_pop(L, 1);
-            lua_pushnumber(L, f);
         }
-        else {
-            lua_Integer n = lua_tointegerx(L, -1, &isnum);
-            if (!isnum) {
-                los_throw(E, LOS_ESIGN);
-            }
-            lua_pop(L, 1);
-            lua_pushinteger(L, n);
+        const char* s = lua_pushlstring(L, B, i);
+        if (lua_stringtonumber(L, s) != i + 1) {
+            los_throw(E, LOS_ESIGN);
         }
+        lua_rotate(L, -2, 1);
+        lua_pop(L, 1);
         return comma ? i + 1 : i;
     }
     return 0;
@@ -1499,27 +7667,55 @@ static int los_pack(lua_State* L)
     jmp_buf E;
     los_try(E);
     luaL_checkany(L, 1);
+    losctx C;
     if (lua_islightuserdata(L, 1)) {
         char* B = lua_touserdata(L, 1);
         size_t size = luaL_checkinteger(L, 2);
         luaL_checkany(L, 3);
+        int flags = packopts(L, 4);
         lua_settop(L, 3);
-        size_t len = packbuf(E, L, B, size);
+        ctxinit(L, &C, flags);
+        lua_pushvalue(L, 3);
+        size_t len = packbuf(E, L, B, size, &C);
         lua_pushinteger(L, len);
         return 1;
     }
     else {
+        int flags = packopts(L, 2);
         lua_settop(L, 1);
-        luaL_Buffer B;
-        luaL_buffinit(L, &B);
-        size_t len = pack(E, L, &B);
+        ctxinit(L, &C, flags);
+        losbuf B;
+        losbuf_init(L, &B);
+        lua_pushvalue(L, 1);
+        size_t len = pack(E, L, &B, &C);
         lua_pushinteger(L, len);
-        luaL_pushresult(&B);
+        losbuf_pushresult(&B);
         return 2;
     }
 }
 
 
+static int los_packto(lua_State* L)
+{
+    jmp_buf E;
+    los_try(E);
+    luaL_checkany(L, 2);
+    lua_Integer chunk = luaL_optinteger(L, 3, LOSBUF_CHUNKSIZE);
+    luaL_argcheck(L, chunk > 0, 3, "chunk size must be positive");
+    int flags = packopts(L, 4);
+    lua_settop(L, 2);
+    losctx C;
+    ctxinit(L, &C, flags);
+    losbuf B;
+    losbuf_initsink(L, &B, 1, (size_t)chunk, &E);
+    lua_pushvalue(L, 2);
+    size_t len = pack(E, L, &B, &C);
+    losbuf_flushall(&B);
+    lua_pushinteger(L, len);
+    return 1;
+}
+
+
 static int los_unpack(lua_State* L)
 {
     jmp_buf E;
@@ -1549,23 +7745,67 @@ static int los_unpack(lua_State* L)
 
 static void los_openpack(lua_State* L)
 {
-    int top = lua_gettop(L);
-    lua_getglobal(L, "string");
-    if (lua_istable(L, -1)) {
-        lua_getfield(L, -1, "format");
-        if (lua_iscfunction(L, -1)) {
-            str_format = lua_tocfunction(L, -1);
-        }
-    }
-    lua_settop(L, top);
-    if (str_format) {
-        luaL_Reg lib[] = {
-            {"pack", los_pack},
-            {"unpack", los_unpack},
-            {NULL, NULL}
-        };
-        luaL_setfuncs(L, lib, 0);
-    }
+    luaL_Reg lib[] = {
+        {"pack", los_pack},
+        {"packto", los_packto},
+        {"unpack", los_unpack},
+        {NULL, NULL}
+    };
+    luaL_setfuncs(L, lib, 0);
+}
+
+
+static void los_openencoder(lua_State* L)
+{
+    luaL_Reg methods[] = {
+        {"dump", los_encoder_dump},
+        {"reset", los_encoder_reset},
+        {"size", los_encoder_size},
+        {"ptr", los_encoder_ptr},
+        {"tostring", los_encoder_tostring},
+        {NULL, NULL}
+    };
+    luaL_newmetatable(L, LOSENC_META);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
+
+
+static void los_opendecoder(lua_State* L)
+{
+    luaL_Reg methods[] = {
+        {"feed", los_decoder_feed},
+        {"reset", los_decoder_reset},
+        {NULL, NULL}
+    };
+    luaL_newmetatable(L, LOSDEC_META);
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
+
+
+static void los_openview(lua_State* L)
+{
+    luaL_Reg meta[] = {
+        {"__index", los_view_index},
+        {"__len", los_view_len},
+        {"__pairs", los_view_pairs},
+        {NULL, NULL}
+    };
+    luaL_newmetatable(L, LOSVIEW_META);
+    luaL_setfuncs(L, meta, 0);
+    lua_pop(L, 1);
+}
+
+
+static void los_openfile(lua_State* L)
+{
+    luaL_newmetatable(L, LOSFILE_META);
+    lua_pushcfunction(L, los_file_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
 }
 
 
@@ -1578,6 +7818,8 @@ static void los_openconst(lua_State* L)
     MCONST(LOS_ESRC, ESRC)
     MCONST(LOS_ESTR, ESTR)
     MCONST(LOS_EFMT, EFMT)
+    MCONST(LOS_EIO, EIO)
+    MCONST(LOS_EMEM, EMEM)
 }
 
 
@@ -1586,6 +7828,8 @@ LUA_MOD_EXPORT int luaopen_los(lua_State* L)
     static_assert(sizeof(lua_Number) == 8, "require 8 bytes lua_Number");
     luaL_Reg lib[] = {
         {"setendian", los_setendian},
+        {"size", los_size},
+        {"hash", los_hash},
         {NULL, NULL}
     };
     luaL_newlib(L, lib);
@@ -1596,6 +7840,11 @@ LUA_MOD_EXPORT int luaopen_los(lua_State* L)
         return 0;
     }
     los_openpack(L);
+    los_openencoder(L);
+    los_opendecoder(L);
+    los_openview(L);
+    los_openfile(L);
+    los_opensplit(L);
     los_openconst(L);
     return 1;
 }
@@ -0,0 +1,68 @@
+local los = require("los")
+local eq = require("test.common").eq
+
+-- equal tables dump to equal bytes whatever order their keys went in
+local keys = {
+    1, 2, 3, 5, -7, 1.5, -0.5, 2^53, math.maxinteger, 2^63, math.mininteger,
+    1 / 0, -1 / 0, true, false, "", "a", "ab", "b", "\0", "\255", "key",
+}
+
+local function build(order, junk)
+    local t = {}
+    for _, i in ipairs(order) do
+        if junk then
+            t["junk" .. i] = i
+        end
+        t[keys[i]] = i
+    end
+    if junk then
+        for _, i in ipairs(order) do
+            t["junk" .. i] = nil
+        end
+    end
+    t.sub = {[1] = 1, [1.5] = 2, [2^53] = 3}
+    return t
+end
+
+local forward, backward, mixed = {}, {}, {}
+for i = 1, #keys do
+    forward[i] = i
+    backward[i] = #keys + 1 - i
+    mixed[i] = (i * 7) % #keys + 1
+end
+
+local a = build(forward)
+local b = build(backward, true)
+local c = build(mixed, true)
+assert(eq(a, b) and eq(a, c))
+
+for _, opts in ipairs({{canonical = true}, {canonical = true, compact = true},
+                       {canonical = true, presize = true}, {canonical = true, shapes = true}}) do
+    local n, s = los.dump(a, opts)
+    assert(select(2, los.dump(b, opts)) == s)
+    assert(select(2, los.dump(c, opts)) == s)
+    local m, v = los.load(s)
+    assert(m == n and eq(v, a))
+end
+
+local _, p = los.pack(a, {canonical = true})
+assert(select(2, los.pack(b, {canonical = true})) == p)
+assert(select(2, los.pack(c, {canonical = true})) == p)
+assert(eq(select(2, los.unpack(p)), a))
+
+-- mixed integer and float keys alone, inserted both ways round
+local x = {[1] = 1, [1.5] = 2, [2^53] = 3}
+local y = {}
+y[2^53] = 3
+y[1.5] = 2
+y[1] = 1
+assert(select(2, los.dump(x, {canonical = true})) == select(2, los.dump(y, {canonical = true})))
+assert(select(2, los.pack(x, {canonical = true})) == select(2, los.pack(y, {canonical = true})))
+
+-- the hash part is written in key order: booleans, numbers, then strings
+local _, s = los.pack({[2^63] = 1, [math.maxinteger] = 2, [1.5] = 3, x = 4, [true] = 5},
+                      {canonical = true})
+assert(s:find("true", 1, true) < s:find("1.8p+0", 1, true))
+assert(s:find("0x1.8p+0", 1, true) < s:find("9223372036854775807", 1, true))
+assert(s:find("9223372036854775807", 1, true) < s:find("0x1p+63", 1, true))
+assert(s:find("0x1p+63", 1, true) < s:find('"x"', 1, true))
@@ -0,0 +1,40 @@
+local los = require("los")
+local common = require("test.common")
+local eq, varint = common.eq, common.varint
+
+-- a block claiming far more rows and columns than it can hold
+local function block(nrows, nkeys, body)
+    local inner = varint(nrows) .. varint(nkeys) .. body
+    return "\xe1\x08\xe6" .. varint(#inner) .. inner
+end
+
+local bomb = block(32000, 4000, string.rep("\0", 4000))
+local t = os.clock()
+assert(los.load(bomb) == los.ESIGN)
+assert(select(1, los.validate(bomb)) == los.ESIGN)
+assert(os.clock() - t < 1)
+
+-- the tightest valid block: boolean columns take a bit per row
+local rows = {}
+for i = 1, 1000 do
+    rows[i] = {a = i % 2 == 0, b = i % 3 == 0}
+end
+for _, opts in ipairs({{columnar = true}, {columnar = true, compact = true}, {columnar = true, presize = true}}) do
+    local n, s = los.dump(rows, opts)
+    assert(los.validate(s) == n)
+    local c, v = los.load(s)
+    assert(c == n and eq(v, rows))
+end
+
+-- every column type round trips
+local mixed = {}
+for i = 1, 50 do
+    mixed[i] = {id = i * 1000, f = i + 0.5, on = i % 2 == 0, name = "n" .. i,
+                kind = i % 3 == 0 and "x" or "y", any = i % 2 == 0 and i or "s"}
+end
+local n, s = los.dump(mixed, {columnar = true})
+assert(s:byte(3) == 0xe6)
+assert(los.validate(s) == n)
+assert(eq(select(2, los.load(s)), mixed))
+
+print("columnar ok")
@@ -0,0 +1,43 @@
+-- Helpers shared by the tests, run from the root of the repository with
+-- the built module on package.cpath: lua test/<name>.lua
+
+local M = {}
+
+function M.eq(a, b)
+    if type(a) ~= type(b) then
+        return false
+    end
+    if type(a) == "number" then
+        if a ~= a then
+            return b ~= b
+        end
+        return a == b and math.type(a) == math.type(b)
+    end
+    if type(a) ~= "table" then
+        return a == b
+    end
+    for k, v in pairs(a) do
+        if not M.eq(v, b[k]) then
+            return false
+        end
+    end
+    for k in pairs(b) do
+        if a[k] == nil then
+            return false
+        end
+    end
+    return true
+end
+
+-- the bytes of n as a compact varint
+function M.varint(n)
+    local t = {}
+    repeat
+        local b = n % 128
+        n = n // 128
+        t[#t + 1] = string.char(n > 0 and b + 128 or b)
+    until n == 0
+    return table.concat(t)
+end
+
+return M
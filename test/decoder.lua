@@ -0,0 +1,117 @@
+local los = require("los")
+local common = require("test.common")
+local eq, varint = common.eq, common.varint
+
+local nan = string.pack("d", 0 / 0)
+
+-- {[nan] = 1}: the value comes before its key in the hash part
+local nankey = "\xfb\xfc\x01\xf0" .. nan .. "\xfd"
+local nilkey = "\xfb\xfc\x01\xf8\xfd"
+
+for _, s in ipairs({nankey, nilkey}) do
+    assert(los.load(s) == los.ESIGN)
+    local d = los.decoder()
+    local ok, n = pcall(d.feed, d, s)
+    assert(ok and n == los.ESIGN)
+    -- a failed decoder stays failed until reset
+    assert(d:feed(select(2, los.dump(1))) == los.ESIGN)
+    d:reset()
+    local c, v = d:feed(select(2, los.dump({1, x = 2})))
+    assert(c == 1 and eq(v, {1, x = 2}))
+    -- fed byte by byte
+    d:reset()
+    local err
+    for i = 1, #s do
+        err = d:feed(s:sub(i, i))
+        if err < 0 then
+            break
+        end
+    end
+    assert(err == los.ESIGN)
+end
+
+-- the same key inside a compressed object, loaded through the decoder
+local _, z = los.dump({[math.pi] = "v"}, {compress = true})
+local f = string.pack("d", math.pi)
+local i = z:find(f, 1, true)
+assert(i, "the float is expected to be stored as a literal")
+local bad = z:sub(1, i - 1) .. nan .. z:sub(i + 8)
+local ok, n = pcall(los.load, bad)
+assert(ok and n == los.ESIGN)
+local d = los.decoder()
+ok, n = pcall(d.feed, d, bad)
+assert(ok and n == los.ESIGN)
+
+-- good objects still round trip, whole and in pieces
+local obj = {1, 2.5, "s", {x = {y = true}}, [1.5] = "f", k = string.rep("z", 300)}
+for _, opts in ipairs({{}, {presize = true}, {shapes = true}, {compress = true}, {dedup = true}}) do
+    local _, s = los.dump(obj, opts)
+    local stream = s .. s
+    for _, step in ipairs({1, 7, #stream}) do
+        local dec = los.decoder()
+        local got = {}
+        for q = 1, #stream, step do
+            local t = table.pack(dec:feed(stream:sub(q, q + step - 1)))
+            assert(t[1] >= 0)
+            for k = 2, t.n do
+                got[#got + 1] = t[k]
+            end
+        end
+        assert(#got == 2 and eq(got[1], obj) and eq(got[2], obj))
+    end
+    local c, v = los.load(s .. "tail")
+    assert(c == #s and eq(v, obj))
+end
+
+-- index blocks and packed arrays are taken as they come, not collected
+-- whole: the items of a block announcing far more than is sent are
+-- decoded without the decoder setting aside room for the rest
+local function grows(prefix)
+    local d = los.decoder()
+    collectgarbage()
+    local before = collectgarbage("count")
+    assert(d:feed(prefix) == 0)
+    assert(d:feed(string.rep("\1", 1000)) == 0)
+    assert(collectgarbage("count") - before < 4096)
+end
+grows("\xe7\x05" .. varint(2^31 - 1))
+grows("\xe1\x40\xea" .. varint(2^40) .. "\xfb\xe0\xf3" .. string.pack("<i4", 2^30) .. "\x00")
+
+local big = {}
+for i = 1, 300 do
+    big[i] = {id = i, tags = {i, i + 1, i + 2, i + 3, i + 4, i + 5, i + 6, i + 7},
+              flags = {true, false, true, true, false, false, true, true, i % 2 == 0},
+              f = {i * 0.5, 1.5, 2.5, 3.5, 4.5, 5.5, 6.5, 7.5}}
+end
+big.name = "big"
+for _, opts in ipairs({{index = true}, {index = true, presize = true}, {index = true, compact = true},
+                       {index = true, compress = true}, {index = true, shapes = true}}) do
+    local _, s = los.dump(big, opts)
+    local stream = s .. s
+    for _, step in ipairs({1, 5, 333, #stream}) do
+        local dec = los.decoder()
+        local got = {}
+        for q = 1, #stream, step do
+            local t = table.pack(dec:feed(stream:sub(q, q + step - 1)))
+            assert(t[1] >= 0)
+            for k = 2, t.n do
+                got[#got + 1] = t[k]
+            end
+        end
+        assert(#got == 2 and eq(got[1], big) and eq(got[2], big))
+    end
+end
+
+-- a block shorter than its table is malformed
+local _, s = los.dump(big, {index = true})
+local len, pos, shift = 0, 4, 0
+repeat
+    local b = s:byte(pos)
+    len = len | (b & 0x7f) << shift
+    pos, shift = pos + 1, shift + 7
+until b < 0x80
+local short = s:sub(1, 3) .. varint(len - 2000) .. s:sub(pos)
+local d = los.decoder()
+assert(d:feed(short) == los.ESIGN)
+
+print("decoder ok")
@@ -0,0 +1,55 @@
+local los = require("los")
+local eq = require("test.common").eq
+
+local path = os.tmpname()
+local obj = {1, "two", {three = 3.5}}
+
+local n = los.dumpfile(path, obj)
+assert(n > 0)
+local c, v = los.loadfile(path)
+assert(c == n and eq(v, obj))
+
+-- a file of the user's next to it is neither used nor touched, except
+-- on Windows where the temporary file is path with .tmp appended
+local function read(p)
+    local f = io.open(p, "rb")
+    if not f then
+        return nil
+    end
+    local s = f:read("a")
+    f:close()
+    return s
+end
+
+local mine = path .. (package.config:sub(1, 1) == "\\" and ".old" or ".tmp")
+local f = assert(io.open(mine, "wb"))
+f:write("mine")
+f:close()
+
+-- a failed dump leaves the previous file whole and no temporary file
+assert(los.dumpfile(path, {1, 2, print}) == los.ETYPE)
+assert(read(mine) == "mine")
+c, v = los.loadfile(path)
+assert(c == n and eq(v, obj))
+
+for _, opts in ipairs({{compress = true}, {index = true, presize = true}}) do
+    assert(los.dumpfile(path, {string.rep("x", 100000), print}, opts) == los.ETYPE)
+    assert(read(mine) == "mine")
+    assert(eq(select(2, los.loadfile(path)), obj))
+end
+
+-- a successful dump replaces it
+local big = {}
+for i = 1, 10000 do
+    big[i] = {id = i, name = "n" .. i}
+end
+n = los.dumpfile(path, big, {compress = true})
+c, v = los.loadfile(path)
+assert(c == n and eq(v, big))
+assert(read(mine) == "mine")
+
+assert(los.dumpfile(path .. "/missing/dir", obj) == los.EIO)
+
+os.remove(path)
+os.remove(mine)
+print("file ok")
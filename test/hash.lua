@@ -0,0 +1,24 @@
+local los = require("los")
+
+-- a table reached again on its own path is an error, not an endless walk
+local t = {}
+t[1] = t
+t[2] = t
+local h, err = los.hash(t)
+assert(h == nil and err == los.ETYPE)
+
+local k = {}
+k[k] = 1
+assert(select(2, los.hash(k)) == los.ETYPE)
+
+local a = {x = {}}
+a.x.y = a
+assert(select(2, los.hash(a)) == los.ETYPE)
+
+-- a table shared between siblings is not a cycle
+local s = {1, 2}
+assert(math.type(los.hash({s, s, [s] = s})) == "integer")
+assert(los.hash({s, s}) == los.hash({{1, 2}, {1, 2}}))
+
+-- the walk path is cleared again after an error
+assert(los.hash({s}) == los.hash({{1, 2}}))
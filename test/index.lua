@@ -0,0 +1,45 @@
+local los = require("los")
+local eq = require("test.common").eq
+
+-- index blocks nested a few levels deep, with array and hash parts
+local function build(depth)
+    local t = {}
+    for i = 1, 20 do
+        t[i] = depth > 0 and i % 5 == 0 and build(depth - 1) or i * 3
+        t["k" .. i] = depth > 0 and i % 7 == 0 and build(depth - 1) or "v" .. i
+    end
+    return t
+end
+local obj = build(3)
+
+for _, opts in ipairs({{index = true}, {index = true, compact = true}, {index = true, canonical = true},
+                       {index = true, presize = true}, {index = true, dedup = true}, {index = true, shapes = true},
+                       {index = true, refs = true}, {index = true, compress = true}}) do
+    local n, s = los.dump(obj, opts)
+    assert(los.size(obj, opts) == n)
+    assert(los.length(s) == n and los.validate(s) == n)
+    local c, v = los.load(s)
+    assert(c == n and eq(v, obj))
+
+    -- streamed in small chunks, no chunk grows past the chunk size
+    local parts, max = {}, 0
+    assert(los.dumpto(function(x)
+        parts[#parts + 1] = x
+        max = math.max(max, #x)
+    end, obj, 1024, opts) == n)
+    assert(table.concat(parts) == s)
+    if not (opts.dedup or opts.shapes or opts.refs or opts.compress) then
+        assert(max <= 1024, max)
+    end
+
+    local e = los.encoder()
+    assert(e:dump(obj, opts) == n and e:tostring() == s)
+end
+
+-- the view finds items through the nested footers
+local _, s = los.dump(obj, {index = true})
+local view = los.view(s)
+assert(view[5][10][15][4] == 12 and obj[5][10][15][4] == 12)
+assert(view.k7.k14.k7.k1 == "v1" and view[20].k3 == "v3")
+
+print("index ok")
@@ -0,0 +1,37 @@
+local los = require("los")
+
+-- records sharing a shape, first met inside an index block and then after it
+local rows = {}
+for i = 1, 20 do
+    rows[i] = {id = i, name = "r" .. i}
+end
+local obj = {rows, {id = 0, name = "after"}, {id = -1, name = "again"}}
+
+local optsets = {{shapes = true}, {shapes = true, index = true}, {shapes = true, index = true, compact = true},
+                 {shapes = true, index = true, compress = true}, {index = true}, {columnar = true, index = true}}
+for _, opts in ipairs(optsets) do
+    local n, s = los.dump(obj, opts)
+    assert(los.length(s) == n, tostring(los.length(s)))
+    assert(los.length(s .. "tail") == n)
+    assert(los.validate(s) == n)
+    -- cutting objects out of a stream by their length
+    local stream = s .. s .. s
+    local pos, count = 1, 0
+    while pos <= #stream do
+        local len = los.length(stream:sub(pos))
+        assert(len == n)
+        pos = pos + len
+        count = count + 1
+    end
+    assert(count == 3)
+    assert(los.length(s:sub(1, n - 1)) < 0)
+end
+
+-- a shape reference no definition came before still fails
+local _, s = los.dump({{a = 1, b = 2}, {a = 3, b = 4}}, {shapes = true})
+local i = s:find("\xe5", 1, true)
+assert(i)
+local bad = s:sub(1, i - 1) .. "\xe4\x05" .. s:sub(i + 2)
+assert(los.length(bad) < 0)
+
+print("length ok")
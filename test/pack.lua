@@ -0,0 +1,27 @@
+local los = require("los")
+local eq = require("test.common").eq
+
+-- pack writes scalars the way string.format("%q") does, and unpack reads
+-- them back
+local values = {
+    math.mininteger, math.maxinteger, 0, -1, 123456789,
+    -0.0, 1 / 0, -1 / 0, 0 / 0, 0.5, -1.25, 2^-1074, 2^-1060 * 3,
+    "", "plain", "\1" .. "2", "\1x", "\0" .. "0", "\31", "\127", "\127" .. "9",
+    "\n", "\r\t", "\\", '"', "a\"b\\c\nd", "\200\255",
+}
+for _, v in ipairs(values) do
+    local n, s = los.pack(v)
+    local q = string.format("%q", v)
+    assert(s == q, ("%s vs %s"):format(s, q))
+    assert(n == #s)
+    local c, u = los.unpack(s)
+    assert(c == n and eq(u, v), s)
+    if v == 0 and math.type(v) == "float" then
+        assert(1 / u == 1 / v)
+    end
+end
+
+-- the same holds inside tables
+local n, s = los.pack(values)
+local c, t = los.unpack(s)
+assert(c == n and eq(t, values))
@@ -0,0 +1,33 @@
+local los = require("los")
+local eq = require("test.common").eq
+
+local rows = {}
+for i = 1, 100 do
+    rows[i] = {id = i, name = "r" .. i, tags = {"a", "b", "c", "d"}}
+end
+
+-- without presize neither the hint nor the header is written
+local _, plain = los.dump({1, 2, 3, 4, 5})
+assert(plain:byte(1) == 0xfb and plain:byte(2) ~= 0xe0)
+
+local _, hinted = los.dump({1, 2, 3, 4, 5}, {presize = true})
+assert(hinted:byte(1) == 0xe1 and hinted:byte(2) & 0x80 ~= 0)
+assert(hinted:byte(3) == 0xfb and hinted:byte(4) == 0xe0)
+
+for _, opts in ipairs({{}, {presize = true}, {presize = true, compact = true},
+                       {presize = true, columnar = true}, {presize = true, compress = true}}) do
+    local n, s = los.dump(rows, opts)
+    assert(los.size(rows, opts) == n)
+    local c, t = los.load(s)
+    assert(c == n and eq(t, rows))
+    local d = los.decoder()
+    local _, u = d:feed(s)
+    assert(eq(u, rows))
+end
+
+-- the hint is only a hint: a wrong one doesn't change what loads
+local _, s = los.dump({1, 2, 3, 4, 5, x = 1}, {presize = true})
+local bad = s:sub(1, 4) .. string.char(40) .. s:sub(6)
+assert(eq(select(2, los.load(bad)), {1, 2, 3, 4, 5, x = 1}))
+
+print("presize ok")
@@ -0,0 +1,56 @@
+local los = require("los")
+local eq = require("test.common").eq
+
+-- load with threads must give what load without does, for any input
+local function same(s)
+    local c1, v1 = los.load(s)
+    local c2, v2 = los.load(s, {threads = 4})
+    assert(c1 == c2, ("%d vs %d"):format(c1, c2))
+    assert(c1 < 0 or los.hash(v1) == los.hash(v2))
+    return c1, v1
+end
+
+-- the bytes of an integer
+local function int(n)
+    return (select(2, los.dump(n)))
+end
+
+local obj = {}
+for i = 1, 20000 do
+    obj[i] = i % 4 == 0 and {id = i, name = "n" .. i} or i % 4 == 1 and "s" .. i or i * 0.5
+end
+obj[100] = nil
+obj.tag = "split"
+
+for _, opts in ipairs({{}, {presize = true}, {compact = true}, {compact = true, presize = true}}) do
+    local n, s = los.dump(obj, opts)
+    assert(n > 65536)
+    local c, v = same(s)
+    assert(c == n and eq(v, obj))
+end
+
+-- a hint claiming more or fewer items than the array part holds
+local n, s = los.dump(obj, {presize = true})
+local hint = int(20000) .. int(1)
+local i = s:find(hint, 1, true)
+assert(i)
+for _, narr in ipairs({40000, 10, 0}) do
+    local t = s:sub(1, i - 1) .. int(narr) .. int(1) .. s:sub(i + #hint)
+    local c, v = same(t)
+    assert(c == #t and eq(v, obj))
+end
+
+-- truncated and damaged inputs fail the same way
+math.randomseed(7)
+for _ = 1, 200 do
+    local t
+    if math.random(2) == 1 then
+        t = s:sub(1, math.random(#s))
+    else
+        local k = math.random(#s)
+        t = s:sub(1, k - 1) .. string.char(math.random(0, 255)) .. s:sub(k + 1)
+    end
+    same(t)
+end
+
+print("split ok")
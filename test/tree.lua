@@ -0,0 +1,33 @@
+local los = require("los")
+local common = require("test.common")
+local eq, varint = common.eq, common.varint
+
+-- load with threads parses the items of a large top-level array into C
+-- trees on other threads, the way los_parse does
+local flags = {}
+for i = 1, 60000 do
+    flags[i] = {on = i % 2 == 0}
+end
+local obj = {flags}
+for i = 2, 8000 do
+    obj[i] = i % 3 == 0 and {i, "s" .. i, {x = i * 0.5}} or "item" .. i
+end
+
+local opts = {columnar = true, presize = true}
+local n, s = los.dump(obj, opts)
+assert(n > 65536)
+local c, v = los.load(s, {threads = 4})
+assert(c == n and eq(v, obj))
+
+-- the first item claims 127 columns for its 60000 rows, which its block
+-- can't hold
+local head = varint(60000) .. varint(1)
+local i = s:find(head, 1, true)
+assert(i)
+local bad = s:sub(1, i - 1) .. varint(60000) .. varint(127) .. s:sub(i + #head)
+local t = os.clock()
+assert(los.load(bad) == los.ESIGN)
+assert(los.load(bad, {threads = 4}) == los.ESIGN)
+assert(os.clock() - t < 1)
+
+print("tree ok")
@@ -0,0 +1,70 @@
+local los = require("los")
+local eq = require("test.common").eq
+
+local function collect(iter, state, init)
+    local t, n = {}, 0
+    for k, v in iter, state, init do
+        assert(v ~= nil)
+        t[k] = v
+        n = n + 1
+    end
+    return t, n
+end
+
+local holes = {
+    {1, nil, 3},
+    {nil, 2},
+    {nil, nil, nil, 4, x = "y"},
+    {1, 2, nil, nil, 5, nil, 7, k = {nil, "v"}},
+}
+local big = {}
+for i = 1, 40 do
+    big[i] = i % 3 ~= 0 and i or nil
+end
+big[40] = 40
+holes[#holes + 1] = big
+
+for _, obj in ipairs(holes) do
+    for _, opts in ipairs({{}, {compact = true}, {index = true}, {presize = true}}) do
+        local _, s = los.dump(obj, opts)
+        local _, loaded = los.load(s)
+        local view = los.view(s)
+        assert(type(view) == "userdata")
+        local got, n = collect(pairs(view))
+        local want, m = collect(pairs(loaded))
+        assert(n == m, n .. " " .. m)
+        for k, v in pairs(want) do
+            if type(v) == "table" then
+                assert(eq(collect(pairs(got[k])), v))
+            else
+                assert(got[k] == v)
+            end
+        end
+        for k in pairs(obj) do
+            assert(view[k] ~= nil)
+        end
+    end
+end
+
+-- los.get walks the same views, decoding only the value at the end: a
+-- sibling holding a NaN key, which load rejects, is skipped unread
+local pi = string.pack("d", math.pi)
+local nan = string.pack("d", 0 / 0)
+local nested = {a = {b = {1, 2, 3, 4, c = "deep"}}, list = {10, 20, 30, 40, 50},
+                bad = {[math.pi] = "v"}}
+for _, opts in ipairs({{}, {compact = true}, {index = true}, {presize = true},
+                       {index = true, presize = true}}) do
+    local _, s = los.dump(nested, opts)
+    local i = assert(s:find(pi, 1, true))
+    s = s:sub(1, i - 1) .. nan .. s:sub(i + 8)
+    assert(los.load(s) == los.ESIGN)
+    assert(type(los.view(s)) == "userdata")
+    local b = los.get(s, "a", "b")
+    assert(type(b) == "table")
+    assert(b.c == "deep" and b[4] == 4)
+    assert(los.get(s, "a", "b", "c") == "deep")
+    assert(los.get(s, "list", 3) == 30)
+    assert(los.get(s, "a", "missing") == nil)
+end
+
+print("view ok")